@@ -0,0 +1,129 @@
+/**
+ * @file
+ * @brief The bounded queue class connects the processing threads (presentation).
+ */
+
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <deque>
+#include <vector>
+#include <iterator>
+#include <utility>
+
+#include <boost/thread.hpp>
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+using namespace std;
+
+namespace slam
+{
+
+template<typename T>
+class BoundedQueue
+{
+
+public:
+
+  /** \brief Class constructor
+   * \param maximum number of queued items (0: unbounded)
+   */
+  explicit BoundedQueue(size_t capacity = 0) : capacity_(capacity), closed_(false) {}
+
+  /** \brief Add an item at the end of the queue. Blocks while the queue is full.
+   * @return false if the queue has been closed
+   * \param the item
+   */
+  bool push(const T& item)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    while (!closed_ && capacity_ > 0 && queue_.size() >= capacity_)
+      not_full_.wait(lock);
+    if (closed_) return false;
+    queue_.push_back(item);
+    stamps_.push_back(now());
+    not_empty_.notify_one();
+    return true;
+  }
+
+  /** \brief Take the item at the front of the queue. The item is moved out of the queue, not copied.
+   * Blocks while the queue is empty.
+   * @return false if the queue has been closed and it is empty
+   * \param output item
+   */
+  bool pop(T& item)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    while (!closed_ && queue_.empty())
+      not_empty_.wait(lock);
+    if (queue_.empty()) return false;
+    item = std::move(queue_.front());
+    queue_.pop_front();
+    stamps_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  /** \brief Take all the queued items at once. The items are moved out of the queue, not copied.
+   * Blocks while the queue is empty.
+   * @return false if the queue has been closed and it is empty
+   * \param output items, in queue order
+   * \param output time (seconds) the oldest item has been waiting in the queue
+   */
+  bool popAll(vector<T>& items, double& oldest_age)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    while (!closed_ && queue_.empty())
+      not_empty_.wait(lock);
+    items.clear();
+    oldest_age = 0.0;
+    if (queue_.empty()) return false;
+    oldest_age = (now() - stamps_.front()).total_microseconds() / 1e6;
+    items.assign(make_move_iterator(queue_.begin()), make_move_iterator(queue_.end()));
+    queue_.clear();
+    stamps_.clear();
+    not_full_.notify_all();
+    return true;
+  }
+
+  /** \brief Close the queue: pending and future pushes fail and pops return the remaining items
+   */
+  void close()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    closed_ = true;
+    not_empty_.notify_all();
+    not_full_.notify_all();
+  }
+
+  /** \brief Get the number of queued items
+   */
+  size_t size() const
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return queue_.size();
+  }
+
+private:
+
+  static boost::posix_time::ptime now() {return boost::posix_time::microsec_clock::universal_time();}
+
+  size_t capacity_; //!> Maximum number of items (0: unbounded)
+
+  bool closed_; //!> True when the queue does not accept more items
+
+  deque<T> queue_; //!> Queued items
+
+  deque<boost::posix_time::ptime> stamps_; //!> Push time of every queued item
+
+  mutable boost::mutex mutex_; //!> Protects the queue
+
+  boost::condition_variable not_empty_; //!> Signaled when an item is pushed
+
+  boost::condition_variable not_full_; //!> Signaled when an item is popped
+
+};
+
+} // namespace
+
+#endif // BOUNDED_QUEUE_H
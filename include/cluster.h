@@ -12,6 +12,8 @@
 #include <opencv2/opencv.hpp>
 #include <opencv2/features2d/features2d.hpp>
 
+#include <boost/shared_ptr.hpp>
+
 using namespace std;
 
 namespace slam
@@ -26,14 +28,14 @@ public:
    */
   Cluster();
 
-  /** \brief Class constructor
+  /** \brief Class constructor. Pass the vectors with std::move to avoid copying them.
    */
-  Cluster(int id, int frame_id, tf::Transform camera_pose, vector<cv::KeyPoint> kp_l, vector<cv::KeyPoint> kp_r, cv::Mat orb_desc, cv::Mat sift_desc, vector<cv::Point3f> points);
+  Cluster(int id, int frame_id, const tf::Transform& camera_pose, vector<cv::KeyPoint> kp_l, vector<cv::KeyPoint> kp_r, const cv::Mat& desc, vector<cv::Point3f> points);
 
   /** \brief Computes and returns the 3D points in world coordinates
    * @return the 3D points in world coordinates
    */
-  vector<cv::Point3f> getWorldPoints();
+  vector<cv::Point3f> getWorldPoints() const;
 
   /** \brief Get the cluster id
    */
@@ -45,23 +47,19 @@ public:
 
   /** \brief Get left cv::KeyPoints
    */
-  inline vector<cv::KeyPoint> getLeftKp() const {return kp_l_;}
+  inline const vector<cv::KeyPoint>& getLeftKp() const {return kp_l_;}
 
   /** \brief Get right cv::KeyPoints
    */
-  inline vector<cv::KeyPoint> getRightKp() const {return kp_r_;}
+  inline const vector<cv::KeyPoint>& getRightKp() const {return kp_r_;}
 
-  /** \brief Get orb descriptors
+  /** \brief Get the matching descriptors (floating point or binary)
    */
-  inline cv::Mat getOrb() const {return orb_desc_;}
-
-  /** \brief Get sift descriptors
-   */
-  inline cv::Mat getSift() const {return sift_desc_;}
+  inline const cv::Mat& getDesc() const {return desc_;}
 
   /** \brief Get 3D camera points
    */
-  inline vector<cv::Point3f> getPoints() const {return points_;}
+  inline const vector<cv::Point3f>& getPoints() const {return points_;}
 
   /** \brief Get camera pose
    */
@@ -80,13 +78,14 @@ private:
 
   vector<cv::KeyPoint> kp_r_; //!> left cv::KeyPoints.
 
-  cv::Mat orb_desc_; //!> ORB descriptors
-  cv::Mat sift_desc_; //!> Sift descriptors
+  cv::Mat desc_; //!> Matching descriptors, also used to compute the hash
 
   vector<cv::Point3f> points_; //!> Stereo 3D points in camera frame
 
 };
 
+typedef boost::shared_ptr<const Cluster> ClusterPtr;
+
 } // namespace
 
 #endif // CLUSTER_H
\ No newline at end of file
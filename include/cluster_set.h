@@ -0,0 +1,91 @@
+/**
+ * @file
+ * @brief The cluster set class stores the keypoint clustering of a frame in compressed (CSR) form (presentation).
+ */
+
+#ifndef CLUSTER_SET_H
+#define CLUSTER_SET_H
+
+#include <vector>
+
+using namespace std;
+
+namespace slam
+{
+
+class ClusterSet
+{
+
+public:
+
+  /** \brief Empty class constructor
+   */
+  ClusterSet() : offsets_(1, 0) {}
+
+  /** \brief Build the clustering from a label per keypoint. The keypoints of every cluster are sorted by index.
+   * \param cluster label of every keypoint (-1 when the keypoint does not belong to any cluster)
+   * \param number of clusters
+   */
+  void build(const vector<int>& labels, int num_clusters)
+  {
+    // Counting sort of the keypoint indices by label
+    offsets_.assign(num_clusters + 1, 0);
+    for (size_t i=0; i<labels.size(); i++)
+    {
+      if (labels[i] >= 0)
+        offsets_[labels[i] + 1]++;
+    }
+    for (int c=0; c<num_clusters; c++)
+      offsets_[c + 1] += offsets_[c];
+
+    indices_.resize(offsets_[num_clusters]);
+    vector<int> next(offsets_.begin(), offsets_.end() - 1);
+    for (size_t i=0; i<labels.size(); i++)
+    {
+      if (labels[i] >= 0)
+        indices_[next[labels[i]]++] = (int)i;
+    }
+  }
+
+  /** \brief Remove all the clusters
+   */
+  inline void clear() {offsets_.assign(1, 0); indices_.clear();}
+
+  /** \brief Get the number of clusters
+   */
+  inline int size() const {return (int)offsets_.size() - 1;}
+
+  /** \brief Get the number of keypoints of a cluster
+   * \param cluster index
+   */
+  inline int clusterSize(int c) const {return offsets_[c + 1] - offsets_[c];}
+
+  /** \brief Get the keypoint indices of a cluster, from begin(c) to end(c)
+   * \param cluster index
+   */
+  inline const int* begin(int c) const {return indices_.data() + offsets_[c];}
+
+  /** \brief Get the end of the keypoint indices of a cluster
+   * \param cluster index
+   */
+  inline const int* end(int c) const {return indices_.data() + offsets_[c + 1];}
+
+  /** \brief Get the keypoint indices of all clusters, cluster after cluster
+   */
+  inline const vector<int>& getIndices() const {return indices_;}
+
+  /** \brief Get the offset of every cluster into the indices (size() + 1 values)
+   */
+  inline const vector<int>& getOffsets() const {return offsets_;}
+
+private:
+
+  vector<int> offsets_; //!> Offset of every cluster into indices_
+
+  vector<int> indices_; //!> Keypoint indices sorted by cluster
+
+};
+
+} // namespace
+
+#endif // CLUSTER_SET_H
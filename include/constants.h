@@ -33,6 +33,32 @@ namespace slam
 
   static const float STEREO_EPIPOLAR_THRESH = 1.0;
 
+  static const float STEREO_MAX_DISPARITY = 300.0;
+
+  static const int KP_GRID_COLS = 8;
+
+  static const int KP_GRID_ROWS = 6;
+
+  static const int TRACKING_QUEUE_SIZE = 2;
+
+  static const float TRACKING_SEARCH_RADIUS = 30.0;
+
+  static const int GRAPH_QUEUE_SIZE = 5;
+
+  static const double GRAPH_RIGID_INFORMATION = 1e6;
+
+  static const double GRAPH_RIGID_GAIN = 100.0;
+
+  static const double GRAPH_GAIN_THRESH = 1e-4;
+
+  static const double GRAPH_DELTA_TRANS_TOL = 0.01;
+
+  static const double GRAPH_DELTA_ROT_TOL = 0.01;
+
+  static const double GRAPH_SNAPSHOT_TRANS_TOL = 0.01;
+
+  static const double GRAPH_SNAPSHOT_ROT_TOL = 0.01;
+
   /*
   DEFAULT VALUES ARE:
   LC_MIN_INLIERS        = 40
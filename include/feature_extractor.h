@@ -0,0 +1,162 @@
+/**
+ * @file
+ * @brief The feature extractor class detects and describes the keypoints of the stereo images (presentation).
+ */
+
+#ifndef FEATURE_EXTRACTOR_H
+#define FEATURE_EXTRACTOR_H
+
+#include <ros/ros.h>
+
+#include <opencv2/opencv.hpp>
+#include <opencv2/features2d.hpp>
+#include <opencv2/xfeatures2d.hpp>
+
+#include <boost/thread.hpp>
+
+using namespace std;
+
+namespace slam
+{
+
+class FeatureExtractor
+{
+
+public:
+
+  struct Params
+  {
+    string type;                      //!> Feature type: SIFT, ORB or AKAZE.
+    double scale;                     //!> Image scale used for the extraction, in (0, 1]. Keypoints are returned in full resolution coordinates.
+    int max_keypoints;                //!> Maximum number of keypoints per image (0: unbounded).
+
+    // Default settings
+    Params () {
+      type = "SIFT";
+      scale = 1.0;
+      max_keypoints = 0;
+    }
+  };
+
+  /** \brief Class constructor. Starts the right image worker thread.
+   */
+  FeatureExtractor();
+
+  /** \brief Class destructor. Stops the right image worker thread.
+   */
+  ~FeatureExtractor();
+
+  /** \brief Set class params and build the detectors. Waits for any running extraction.
+   * \param the parameters struct
+   */
+  void setParams(const Params& params);
+
+  /** \brief Get class params
+   */
+  inline Params getParams() const {return params_;}
+
+  /** \brief True when the descriptors are binary (matched with Hamming distance)
+   */
+  inline bool isBinary() const {return params_.type != "SIFT";}
+
+  /** \brief Extract the keypoints and descriptors of both stereo images.
+   * The left image is processed in the calling thread while the right one is processed in a persistent worker
+   * thread, created with the extractor and fed through a condition variable. When the extraction scale is
+   * lower than one the images are downscaled before the extraction and the keypoints are mapped back to full
+   * resolution.
+   * When the keypoints are bounded, the keypoints and their descriptors are culled after the extraction (see
+   * retainBest), so the scale space of every image is built only once.
+   * The detectors keep internal state, so the extractions are serialized: this method can be called from
+   * several threads (the tracking features and pose threads), but only one call runs at a time. The matching
+   * methods are const and can run concurrently.
+   * \param left grayscale image
+   * \param right grayscale image
+   * \param output left keypoints
+   * \param output right keypoints
+   * \param output left descriptors
+   * \param output right descriptors
+   */
+  void extract(const cv::Mat& l_img, const cv::Mat& r_img,
+               vector<cv::KeyPoint>& l_kp, vector<cv::KeyPoint>& r_kp,
+               cv::Mat& l_desc, cv::Mat& r_desc);
+
+  /** \brief Ratio matching between descriptors
+   * \param Descriptors of image 1
+   * \param Descriptors of image 2
+   * \param ratio value (0.6/0.9)
+   * \param output matching
+   */
+  void ratioMatching(const cv::Mat& desc_1, const cv::Mat& desc_2, double ratio, vector<cv::DMatch>& matches) const;
+
+  /** \brief Ratio matching between the left and right descriptors of a rectified stereo pair.
+   * The right keypoints are indexed by image row, so every left keypoint is only compared with the right
+   * keypoints inside its epipolar band (STEREO_EPIPOLAR_THRESH, widened by the inverse of the extraction
+   * scale) and disparity range (STEREO_MAX_DISPARITY). Left keypoints with less than two candidates are
+   * discarded, as they can not be verified by the ratio test.
+   * \param left keypoints
+   * \param right keypoints
+   * \param left descriptors
+   * \param right descriptors
+   * \param ratio value (0.6/0.9)
+   * \param output matching (query: left, train: right)
+   */
+  void stereoMatching(const vector<cv::KeyPoint>& l_kp, const vector<cv::KeyPoint>& r_kp,
+                      const cv::Mat& l_desc, const cv::Mat& r_desc,
+                      double ratio, vector<cv::DMatch>& matches) const;
+
+  /** \brief Reduce the keypoints to a budget keeping them evenly spread over the image. The keypoints are
+   * bucketed in a KP_GRID_COLS x KP_GRID_ROWS grid and retained by rank inside their cell: first the best
+   * keypoint of every cell, then the second best, and so on. The last rank is filled with the strongest
+   * keypoints. The selection is deterministic and keeps the original keypoint order.
+   * \param keypoints to filter (in/out)
+   * \param image size
+   * \param maximum number of keypoints (0: unbounded)
+   * \param optional descriptors of the keypoints, one row per keypoint, filtered with them (in/out)
+   */
+  static void retainBest(vector<cv::KeyPoint>& kp, const cv::Size& img_size, int max_keypoints, cv::Mat* desc = NULL);
+
+  /** \brief Convert descriptors to floating point. Binary descriptors are unpacked to one 0/1 value per bit.
+   * @return the floating point descriptors (the input itself when it is already floating point)
+   * \param the descriptors
+   */
+  static cv::Mat toFloatDescriptors(const cv::Mat& desc);
+
+protected:
+
+  /** \brief Build a detector for the configured feature type
+   * @return the feature detector/descriptor
+   */
+  cv::Ptr<cv::Feature2D> createDetector();
+
+  /** \brief Right image worker: waits for an image and extracts its features
+   */
+  void workerThread();
+
+private:
+
+  Params params_; //!> Stores parameters.
+
+  cv::Ptr<cv::Feature2D> l_detector_; //!> Left image detector/descriptor
+  cv::Ptr<cv::Feature2D> r_detector_; //!> Right image detector/descriptor
+
+  boost::mutex mutex_extract_; //!> Serializes the use of the detectors
+
+  boost::thread worker_; //!> Right image worker thread
+
+  boost::mutex mutex_worker_; //!> Protects the worker job
+
+  boost::condition_variable worker_cond_; //!> Signals a new job, its completion and the worker stop
+
+  const cv::Mat* job_img_; //!> Image of the worker job
+  vector<cv::KeyPoint>* job_kp_; //!> Output keypoints of the worker job
+  cv::Mat* job_desc_; //!> Output descriptors of the worker job
+
+  bool job_pending_; //!> True while the worker job is not finished
+
+  bool stop_; //!> Set to stop the worker thread
+
+};
+
+} // namespace
+
+#endif // FEATURE_EXTRACTOR_H
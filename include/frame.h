@@ -7,6 +7,8 @@
 #define FRAME_H
 
 #include <ros/ros.h>
+#include <sensor_msgs/Image.h>
+#include <sensor_msgs/PointCloud2.h>
 #include <image_geometry/stereo_camera_model.h>
 #include <tf/transform_datatypes.h>
 #include <tf_conversions/tf_eigen.h>
@@ -18,6 +20,12 @@
 
 #include <pcl/point_types.h>
 
+#include <boost/shared_ptr.hpp>
+
+#include "feature_extractor.h"
+#include "keypoint_grid.h"
+#include "cluster_set.h"
+
 using namespace std;
 using namespace pcl;
 
@@ -38,21 +46,60 @@ public:
    */
   Frame();
 
-  /** \brief Class constructor
+  /** \brief Class constructor. The features are not computed until computeFeatures is called.
+   * The messages are kept to decode the images only when needed.
+   * \param left image message
+   * \param right image message
+   * \param stereo camera model
+   * \param frame timestamp
+   * \param feature extractor used to detect and describe the keypoints
+   */
+  Frame(const sensor_msgs::ImageConstPtr& l_img_msg, const sensor_msgs::ImageConstPtr& r_img_msg,
+        const image_geometry::StereoCameraModel& camera_model, double timestamp, FeatureExtractor* feature_extractor);
+
+  /** \brief Compute the keypoints, descriptors, stereo matches and 3D points of the frame. Only the first
+   * call does the work. The images are converted to grayscale sharing the message data when they are
+   * already mono8.
+   */
+  void computeFeatures();
+
+  /** \brief True when the features have been computed
+   */
+  inline bool hasFeatures() const {return has_features_;}
+
+  /** \brief Convert the images to grayscale, sharing the message data when they are already mono8.
+   * Only the first call does the work.
+   * @return false if the images can not be converted
+   */
+  bool decodeImages();
+
+  /** \brief Decode the left colour image. It may share the message data: clone it before drawing.
+   */
+  cv::Mat getLeftImg() const;
+
+  /** \brief Decode the right colour image. It may share the message data: clone it before drawing.
    */
-  Frame(cv::Mat l_img, cv::Mat r_img, image_geometry::StereoCameraModel camera_model, double timestamp);
+  cv::Mat getRightImg() const;
 
-  /** \brief Get left image
+  /** \brief Get left grayscale image
    */
-  inline cv::Mat getLeftImg() const {return l_img_;}
+  inline const cv::Mat& getLeftImgGray() const {return l_img_gray_;}
 
-  /** \brief Get right image
+  /** \brief Get right grayscale image
    */
-  inline cv::Mat getRightImg() const {return r_img_;}
+  inline const cv::Mat& getRightImgGray() const {return r_img_gray_;}
+
+  /** \brief Get left image message
+   */
+  inline const sensor_msgs::ImageConstPtr& getLeftImgMsg() const {return l_img_msg_;}
+
+  /** \brief Get right image message
+   */
+  inline const sensor_msgs::ImageConstPtr& getRightImgMsg() const {return r_img_msg_;}
 
   /** \brief Get left keypoints
    */
-  inline vector<cv::KeyPoint> getLeftKp() const {return l_kp_;}
+  inline const vector<cv::KeyPoint>& getLeftKp() const {return l_kp_;}
 
   /** \brief Set left keypoints
    * \param vector of keypoints
@@ -61,19 +108,19 @@ public:
 
   /** \brief Get right keypoints
    */
-  inline vector<cv::KeyPoint> getRightKp() const {return r_kp_;}
+  inline const vector<cv::KeyPoint>& getRightKp() const {return r_kp_;}
 
   /** \brief Get left non-filtered keypoints
    */
-  inline vector<cv::KeyPoint> getNonFilteredLeftKp() const {return l_nonfiltered_kp_;}
+  inline const vector<cv::KeyPoint>& getNonFilteredLeftKp() const {return l_nonfiltered_kp_;}
 
   /** \brief Get right non-filtered keypoints
    */
-  inline vector<cv::KeyPoint> getNonFilteredRightKp() const {return r_nonfiltered_kp_;}
+  inline const vector<cv::KeyPoint>& getNonFilteredRightKp() const {return r_nonfiltered_kp_;}
 
   /** \brief Get left descriptors
    */
-  inline cv::Mat getLeftDesc() const {return l_desc_;}
+  inline const cv::Mat& getLeftDesc() const {return l_desc_;}
 
   /** \brief Set left descriptors
    * \param vector of descriptors
@@ -82,11 +129,11 @@ public:
 
   /** \brief Get stereo matches
    */
-  inline vector<cv::DMatch> getMatches() const {return matches_filtered_;}
+  inline const vector<cv::DMatch>& getMatches() const {return matches_filtered_;}
 
   /** \brief Get 3D in camera frame
    */
-  inline vector<cv::Point3f> getCameraPoints() const {return camera_points_;}
+  inline const vector<cv::Point3f>& getCameraPoints() const {return camera_points_;}
 
   /** \brief Set frame id
    * \param vector of 3D points
@@ -103,20 +150,20 @@ public:
    */
   inline void setCameraPose(const tf::Transform& camera_pose){camera_pose_ = camera_pose;}
 
-  /** \brief Set pointcloud
-   * \param pointcloud
+  /** \brief Set the pointcloud message. It is only converted when needed.
+   * \param pointcloud message
    */
-  inline void setPointCloud(const PointCloudRGB::Ptr pointcloud){pointcloud_ = pointcloud;}
+  inline void setPointCloudMsg(const sensor_msgs::PointCloud2ConstPtr& cloud_msg){cloud_msg_ = cloud_msg;}
 
   /** \brief Set number of inliers with the previous frame
    * \param number of inliers between current frame and previous
    */
   inline void setInliersNumWithPreviousFrame(const int& num_inliers){num_inliers_with_prev_frame_ = num_inliers;}
 
-  /** \brief Set sigma with the previous frame
-   * \param sigma matrix between current frame and previous
+  /** \brief Set the information matrix of the motion from the previous frame
+   * \param information matrix (6x6, translation and rotation)
    */
-  inline void setSigmaWithPreviousFrame(const cv::Mat& sigma){sigma_with_prev_frame_ = sigma;}
+  inline void setInformationWithPreviousFrame(const cv::Mat& information){information_with_prev_frame_ = information;}
 
   /** \brief Get frame id
    */
@@ -128,32 +175,27 @@ public:
 
   /** \brief Return the clustering for the current frame
    */
-  inline vector< vector<int> > getClusters() const {return clusters_;}
+  inline const ClusterSet& getClusters() const {return clusters_;}
 
   /** \brief Return the clustering for the current frame
    */
-  inline vector<Eigen::Vector4f> getClusterCentroids() const {return cluster_centroids_;}
+  inline const vector<Eigen::Vector4f>& getClusterCentroids() const {return cluster_centroids_;}
 
   /** \brief Get frame timestamp
    */
   inline double getTimestamp() const {return stamp_;}
 
-  /** \brief Get frame pointcloud
+  /** \brief Get frame pointcloud message
    */
-  inline PointCloudRGB::Ptr getPointCloud() const {return pointcloud_;}
+  inline const sensor_msgs::PointCloud2ConstPtr& getPointCloudMsg() const {return cloud_msg_;}
 
   /** \brief Get frame inliers with previous frame
    */
   inline int getInliersNumWithPreviousFrame() const {return num_inliers_with_prev_frame_;}
 
-  /** \brief Get frame sigma with previous frame
-   */
-  inline cv::Mat getSigmaWithPreviousFrame() const {return sigma_with_prev_frame_;}
-
-  /** \brief Compute sift descriptors
-   * @return the matrix of sift descriptors
+  /** \brief Get the information matrix of the motion from the previous frame
    */
-  cv::Mat computeSift();
+  inline const cv::Mat& getInformationWithPreviousFrame() const {return information_with_prev_frame_;}
 
   /** \brief Cluster the points
    */
@@ -162,19 +204,28 @@ public:
 protected:
 
   /** \brief Search keypoints into region
-   * @return the list of keypoints into a certain region
-   * \param list of keypoints
-   * \param query keypoint
+   * \param spatial index of the left keypoints
+   * \param query keypoint index
    * \param maximum distance to considerate a keypoint into the region
+   * \param output list of keypoints into the region, sorted by index
    */
-  vector<int> regionQuery(vector<cv::KeyPoint> *keypoints, cv::KeyPoint *keypoint, float eps);
+  void regionQuery(const KeypointGrid& grid, int idx, float eps, vector<int>& neighbors);
 
 private:
 
   int id_; //!> Frame id
 
-  cv::Mat l_img_; //!> Left image
-  cv::Mat r_img_; //!> Right image
+  bool has_features_; //!> True when the features have been computed
+
+  image_geometry::StereoCameraModel camera_model_; //!> Stereo camera model, used to compute the features
+
+  FeatureExtractor* feature_extractor_; //!> Feature extractor, used to compute the features
+
+  sensor_msgs::ImageConstPtr l_img_msg_; //!> Left image message
+  sensor_msgs::ImageConstPtr r_img_msg_; //!> Right image message
+
+  cv::Mat l_img_gray_; //!> Left grayscale image (may share the message data)
+  cv::Mat r_img_gray_; //!> Right grayscale image (may share the message data)
 
   vector<cv::KeyPoint> l_kp_; //!> Left keypoints.
   vector<cv::KeyPoint> r_kp_; //!> Right keypoints.
@@ -189,7 +240,7 @@ private:
 
   vector<cv::Point3f> camera_points_; //!> Stereo 3D points in camera frame
 
-  vector< vector<int> > clusters_; //!> Keypoints clustering
+  ClusterSet clusters_; //!> Keypoints clustering
 
   vector<Eigen::Vector4f> cluster_centroids_; //!> Central point for every cluster
 
@@ -197,16 +248,18 @@ private:
 
   double stamp_; //!> Store the frame timestamp
 
-  PointCloudRGB::Ptr pointcloud_; //!> The pointcloud for this frame
+  sensor_msgs::PointCloud2ConstPtr cloud_msg_; //!> The pointcloud message for this frame
 
   ros::Publisher kp_pub_; //!> Keypoints publisher
 
   int num_inliers_with_prev_frame_; //!> Number of inliers between this frame and the previous
 
-  cv::Mat sigma_with_prev_frame_; //!> The sigma value with previous frame
+  cv::Mat information_with_prev_frame_; //!> The information matrix of the motion from the previous frame
 
 };
 
+typedef boost::shared_ptr<Frame> FramePtr;
+
 } // namespace
 
 #endif // FRAME_H
\ No newline at end of file
@@ -10,6 +10,9 @@
 #include <tf/transform_broadcaster.h>
 #include <image_geometry/pinhole_camera_model.h>
 #include <nav_msgs/Odometry.h>
+#include <std_msgs/Int32.h>
+#include <std_msgs/Float32.h>
+#include <std_srvs/Empty.h>
 
 #include <cv.h>
 #include <highgui.h>
@@ -20,14 +23,18 @@
 #include <g2o/types/slam3d/edge_se3.h>
 #include <g2o/solvers/cholmod/linear_solver_cholmod.h>
 #include <g2o/core/optimization_algorithm_levenberg.h>
+#include <g2o/core/sparse_optimizer_terminate_action.h>
 
 #include <boost/thread.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
 
-#include "frame.h"
+#include "keyframe.h"
 #include "loop_closing.h"
+#include "bounded_queue.h"
+#include "pair_registry.h"
 #include "stereo_slam/GraphPoses.h"
+#include "stereo_slam/GraphPosesDelta.h"
 
 using namespace std;
 using namespace boost;
@@ -43,20 +50,28 @@ class Graph
 
 public:
 
-  struct Edge
+  struct VertexRecord
   {
-    int vertice_a;
-    int vertice_b;
-    int inliers;
-
-    // Default settings
-    Edge (int a, int b, int inlier) {
-      vertice_a  = a;
-      vertice_b  = b;
-      inliers = inlier;
+    int frame_id;                     //!> Frame of the vertex
+    tf::Transform local_pose;         //!> Vertex pose relative to the frame camera
+    tf::Transform initial_pose;       //!> Vertex pose before any graph update
+    g2o::VertexSE3* vertex;           //!> The g2o vertex (owned by the optimizer)
+
+    VertexRecord (int frame, const tf::Transform& local, const tf::Transform& initial, g2o::VertexSE3* v) {
+      frame_id     = frame;
+      local_pose   = local;
+      initial_pose = initial;
+      vertex       = v;
     }
   };
 
+  struct QueuedFrame
+  {
+    KeyFramePtr keyframe;                   //!> The shared keyframe record
+    sensor_msgs::ImageConstPtr l_img_msg;   //!> Left image message, dropped once the keyframe images are saved
+    sensor_msgs::ImageConstPtr r_img_msg;   //!> Right image message, dropped once the keyframe images are saved
+  };
+
 	/** \brief Class constructor
    * \param Loop closing object pointer
    */
@@ -70,19 +85,35 @@ public:
    */
   void run();
 
-  /** \brief Add a frame to the queue of frames to be inserted into the graph as vertices
-   * \param The frame to be inserted
+  /** \brief Stops the graph thread: the frames queue is closed. Once the thread has processed the
+   * remaining frames, a final snapshot of the graph files is written.
    */
-  void addFrameToQueue(Frame frame);
+  void finalize();
 
-  /** \brief Add an edge to the graph
+  /** \brief Add a frame to the queue of frames to be inserted into the graph as vertices.
+   * Blocks while the queue is full, so the tracking waits when the graph falls behind.
+   * \param The keyframe to be inserted (shared, not copied)
+   * \param Left image message of the keyframe
+   * \param Right image message of the keyframe
+   */
+  void addFrameToQueue(const KeyFramePtr& frame, const sensor_msgs::ImageConstPtr& l_img_msg,
+                       const sensor_msgs::ImageConstPtr& r_img_msg);
+
+  /** \brief Add an edge to the graph. The loop closing edges are appended to the edges file.
    * \param Index of vertex 1
    * \param Index of vertex 2
    * \param Transformation between vertices
-   * \param Sigma information
+   * \param Information matrix (6x6, translation and rotation vector errors)
    * \param Inliers
    */
-  void addEdge(int i, int j, tf::Transform edge, cv::Mat sigma, int inliers);
+  void addEdge(int i, int j, tf::Transform edge, const cv::Mat& information, int inliers);
+
+  /** \brief Add an edge between two vertices of the same frame, which are rigidly attached
+   * \param Index of vertex 1
+   * \param Index of vertex 2
+   * \param Transformation between vertices
+   */
+  void addRigidEdge(int i, int j, tf::Transform edge);
 
   /** \brief Optimize the graph
    */
@@ -141,10 +172,18 @@ public:
    */
   tf::Transform getVertexCameraPose(int id, bool lock = true);
 
-  /** \brief Save the graph to file
+  /** \brief Append the new frame poses to the vertices file
    */
   void saveGraph();
 
+  /** \brief Compact the graph files: the vertices and edges files, which are append-only journals, are
+   * rewritten with the optimized poses. The files are replaced atomically (written to a temporal file and
+   * renamed), so readers never see them half written.
+   * \param false to rewrite the files only when some frame moved beyond GRAPH_SNAPSHOT_TRANS_TOL or
+   * GRAPH_SNAPSHOT_ROT_TOL from the pose written in the vertices file
+   */
+  void saveGraphSnapshot(bool force = false);
+
   /** \brief Set the transformation between camera and robot odometry frame
    * \param the transform
    */
@@ -186,25 +225,76 @@ protected:
    */
   vector< vector<int> > createComb(vector<int> cluster_ids);
 
-  /** \brief Check if there are frames in the queue to be inserted into the graph
-   * @return true if frames queue is not empty.
+  /** \brief Converts the frame to a graph vertex and adds it to the graph
+   * \param the queued frame
    */
-  bool checkNewFrameInQueue();
+  void processNewFrame(const QueuedFrame& queued_frame);
 
-  /** \brief Converts the frame to a graph vertex and adds it to the graph
+  /** \brief Publishes the frames queue depth and age
+   * \param number of frames taken from the queue
+   * \param time (seconds) the oldest frame has been waiting in the queue
    */
-  void processNewFrame();
+  void publishQueueState(int depth, double age);
 
   /** \brief Add a vertex to the graph
    * @return the vertex id
    * \param Vertex pose
+   * \param Frame id of the vertex
+   * \param Vertex pose relative to the frame camera
+   */
+  int addVertex(const tf::Transform& pose, int frame_id, const tf::Transform& local_pose);
+
+  /** \brief Information matrix of the rigid edges, relative to the strongest edge information
+   * @return the information matrix (g2o units: translation and quaternion imaginary part)
+   */
+  Eigen::Matrix<double, 6, 6> rigidInformation() const;
+
+  /** \brief Create an edge and add it to the optimizer (the graph must be locked)
+   * @return the new edge (owned by the optimizer)
+   * \param Index of vertex 1
+   * \param Index of vertex 2
+   * \param Transformation between vertices
+   * \param Information matrix (g2o units)
+   */
+  g2o::EdgeSE3* insertEdge(int i, int j, const tf::Transform& edge, const Eigen::Matrix<double, 6, 6>& information);
+
+  /** \brief Save the frame images to the default location
+   * \param the queued frame, with its images
+   */
+  void saveFrame(const QueuedFrame& queued_frame);
+
+  /** \brief Get the camera pose of the frames (the pose of their first vertex)
+   * @return the number of frames of the graph when the poses were collected
+   * \param first frame id
+   * \param output frame ids
+   * \param output camera poses
+   * \param optional output frame timestamps
+   */
+  int getFramePoses(int first_frame, vector<int>& frame_ids, vector<tf::Transform>& poses,
+                    vector<double>* stamps = NULL);
+
+  /** \brief Format the poses of the frames, one line per frame
+   * \param frame ids
+   * \param frame timestamps
+   * \param frame camera poses
+   * \param output text, the lines are appended
    */
-  int addVertex(tf::Transform pose);
+  void formatVertices(const vector<int>& frame_ids, const vector<double>& stamps,
+                      const vector<tf::Transform>& poses, string& out);
 
-  /** \brief Save the frame to the default location
-   * \param the frame to be drawn
+  /** \brief Store the poses written to the vertices file (the files must be locked)
+   * \param frame ids
+   * \param frame camera poses
    */
-  void saveFrame(Frame frame);
+  void setSavedPoses(const vector<int>& frame_ids, const vector<tf::Transform>& poses);
+
+  /** \brief Write a graph file
+   * @return true if the file was written
+   * \param file path
+   * \param the data
+   * \param true to append the data, false to replace the file atomically
+   */
+  bool writeFile(const string& file, const string& data, bool append);
 
   /** \brief Publishes the graph camera pose
    * \param Camera pose
@@ -215,25 +305,44 @@ protected:
    */
   void publishGraph();
 
+  /** \brief Publishes the graph poses that changed since the last delta: the new frames and the frames
+   * that moved more than the tolerance
+   * \param true to consider only the new frames (no optimization since the last delta)
+   * \param true to publish all the frames (full snapshot)
+   */
+  void publishGraphDelta(bool only_new, bool snapshot = false);
+
+  /** \brief Service callback: publishes a full snapshot on the delta topic
+   */
+  bool publishSnapshot(std_srvs::Empty::Request& req, std_srvs::Empty::Response& res);
+
 private:
 
   g2o::SparseOptimizer graph_optimizer_; //!> G2O graph optimizer
 
-  list<Frame> frame_queue_; //!> Frames queue to be inserted into the graph
+  bool optimizer_stop_flag_; //!> Set by the terminate action to stop the optimization
 
-  int frame_id_; //!> Processed frames counter
+  BoundedQueue<QueuedFrame> frame_queue_; //!> Frames queue to be inserted into the graph
 
-  vector< pair< int,int > > cluster_frame_relation_; //!> Stores the cluster/frame relation (cluster_id, frame_id)
+  int frame_id_; //!> Processed frames counter
 
-  vector<tf::Transform> local_cluster_poses_; //!> Stores the cluster poses relative to camera frame
+  vector<VertexRecord> vertices_; //!> Vertex information, indexed by vertex id
 
-  vector<tf::Transform> initial_cluster_pose_history_; //!> Stores the initial cluster poses, before graph update.
+  vector< pair<int, int> > frame_vertices_; //!> First vertex id and number of vertices, indexed by frame id
 
   vector<double> frame_stamps_; //> Stores the frame timestamps
 
   mutex mutex_graph_; //!> Mutex for the graph manipulation
 
-  mutex mutex_frame_queue_; //!> Mutex for the insertion of new frames into the graph
+  mutex mutex_files_; //!> Mutex for the graph files
+
+  string vertices_file_; //!> Graph vertices file
+
+  string edges_file_; //!> Graph edges file (loop closings)
+
+  int saved_frames_; //!> Number of frames already written to the vertices file
+
+  vector<tf::Transform> saved_poses_; //!> Camera pose of every frame in the vertices file, indexed by frame id
 
   tf::Transform camera2odom_; //!> Transformation between camera and robot odometry frame
 
@@ -247,7 +356,31 @@ private:
 
   ros::Publisher graph_pub_; //!> Graph publisher
 
-  vector<Edge> edges_information_; // Edges information
+  ros::Publisher queue_pub_; //!> Frames queue depth publisher
+
+  ros::Publisher queue_age_pub_; //!> Frames queue age publisher
+
+  PairRegistry frame_edges_; //!> Accumulated inliers of the edges between every pair of frames
+
+  ros::Publisher graph_delta_pub_; //!> Graph poses delta publisher
+
+  ros::ServiceServer snapshot_srv_; //!> Service to publish a full snapshot on the delta topic
+
+  uint32_t delta_version_; //!> Version of the last graph poses delta
+
+  vector<tf::Transform> published_poses_; //!> Last published pose of every frame, indexed by frame id
+
+  vector<bool> published_frames_; //!> True for the frames published on the delta topic
+
+  mutex mutex_published_; //!> Mutex for the published poses
+
+  mutex mutex_run_; //!> Held while the graph thread runs
+
+  vector<g2o::EdgeSE3*> rigid_edges_; //!> Edges between the vertices of the same frame
+
+  double max_trans_information_; //!> Largest translation information of the non rigid edges
+
+  double max_rot_information_; //!> Largest rotation information of the non rigid edges
 };
 
 } // namespace
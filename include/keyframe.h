@@ -0,0 +1,112 @@
+/**
+ * @file
+ * @brief The keyframe class is the compact record of a frame inserted into the map (presentation).
+ */
+
+#ifndef KEYFRAME_H
+#define KEYFRAME_H
+
+#include <ros/ros.h>
+#include <tf/transform_datatypes.h>
+
+#include <opencv2/opencv.hpp>
+
+#include <boost/shared_ptr.hpp>
+
+#include "frame.h"
+
+using namespace std;
+
+namespace slam
+{
+
+class KeyFrame
+{
+
+public:
+
+  /** \brief Empty class constructor
+   */
+  KeyFrame();
+
+  /** \brief Class constructor. Keeps only the frame data needed by the graph and the loop closing. The record
+   * is immutable once built, so it is shared between threads without copies (see KeyFramePtr). The images are
+   * not part of it: they travel next to the keyframe until they are saved.
+   * \param the tracked frame
+   */
+  explicit KeyFrame(const Frame& frame);
+
+  /** \brief Get frame id
+   */
+  inline int getId() const {return id_;}
+
+  /** \brief Get frame timestamp
+   */
+  inline double getTimestamp() const {return stamp_;}
+
+  /** \brief Get camera pose
+   */
+  inline tf::Transform getCameraPose() const {return camera_pose_;}
+
+  /** \brief Get left keypoints
+   */
+  inline const vector<cv::KeyPoint>& getLeftKp() const {return l_kp_;}
+
+  /** \brief Get right keypoints
+   */
+  inline const vector<cv::KeyPoint>& getRightKp() const {return r_kp_;}
+
+  /** \brief Get left descriptors
+   */
+  inline const cv::Mat& getLeftDesc() const {return l_desc_;}
+
+  /** \brief Get 3D in camera frame
+   */
+  inline const vector<cv::Point3f>& getCameraPoints() const {return camera_points_;}
+
+  /** \brief Return the clustering for the current frame
+   */
+  inline const ClusterSet& getClusters() const {return clusters_;}
+
+  /** \brief Return the clustering for the current frame
+   */
+  inline const vector<Eigen::Vector4f>& getClusterCentroids() const {return cluster_centroids_;}
+
+  /** \brief Get frame inliers with previous frame
+   */
+  inline int getInliersNumWithPreviousFrame() const {return num_inliers_with_prev_frame_;}
+
+  /** \brief Get the information matrix of the motion from the previous frame
+   */
+  inline const cv::Mat& getInformationWithPreviousFrame() const {return information_with_prev_frame_;}
+
+private:
+
+  int id_; //!> Frame id
+
+  double stamp_; //!> Store the frame timestamp
+
+  tf::Transform camera_pose_; //!> Camera world position for this frame
+
+  vector<cv::KeyPoint> l_kp_; //!> Left keypoints.
+  vector<cv::KeyPoint> r_kp_; //!> Right keypoints.
+
+  cv::Mat l_desc_; //!> Left descriptors.
+
+  vector<cv::Point3f> camera_points_; //!> Stereo 3D points in camera frame
+
+  ClusterSet clusters_; //!> Keypoints clustering
+
+  vector<Eigen::Vector4f> cluster_centroids_; //!> Central point for every cluster
+
+  int num_inliers_with_prev_frame_; //!> Number of inliers between this frame and the previous
+
+  cv::Mat information_with_prev_frame_; //!> The information matrix of the motion from the previous frame
+
+};
+
+typedef boost::shared_ptr<const KeyFrame> KeyFramePtr;
+
+} // namespace
+
+#endif // KEYFRAME_H
@@ -0,0 +1,69 @@
+/**
+ * @file
+ * @brief The keypoint grid class is a spatial index to search image keypoints by region (presentation).
+ */
+
+#ifndef KEYPOINT_GRID_H
+#define KEYPOINT_GRID_H
+
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+
+namespace slam
+{
+
+class KeypointGrid
+{
+
+public:
+
+  /** \brief Empty class constructor
+   */
+  KeypointGrid();
+
+  /** \brief Class constructor. Builds the grid index.
+   * \param list of keypoints (only the positions are indexed)
+   * \param size of the grid cells in pixels. Use the search radius for best performance.
+   */
+  KeypointGrid(const vector<cv::KeyPoint>& keypoints, float cell_size);
+
+  /** \brief Search the keypoints inside a circular region
+   * \param center of the region
+   * \param radius of the region (keypoints at distance <= radius are included)
+   * \param output list of keypoint indices, sorted in ascending order
+   */
+  void radiusSearch(const cv::Point2f& center, float radius, vector<int>& indices) const;
+
+  /** \brief Get the number of indexed keypoints
+   */
+  inline int size() const {return (int)points_.size();}
+
+protected:
+
+  /** \brief Get the cell coordinate of an image coordinate
+   * @return the cell coordinate (can be out of the grid)
+   * \param image coordinate
+   * \param minimum image coordinate of the grid
+   */
+  inline int toCell(float v, float min_v) const {return (int)floor((v - min_v) / cell_size_);}
+
+private:
+
+  float cell_size_; //!> Cell size in pixels
+
+  float min_x_, min_y_; //!> Grid origin
+
+  int cols_, rows_; //!> Grid size
+
+  vector<cv::Point2f> points_; //!> Keypoint positions
+
+  vector<int> cell_start_; //!> Offset of every cell into cell_indices_ (size cols*rows+1)
+
+  vector<int> cell_indices_; //!> Keypoint indices sorted by cell and, inside a cell, by index
+
+};
+
+} // namespace
+
+#endif // KEYPOINT_GRID_H
@@ -17,6 +17,10 @@
 #include "constants.h"
 #include "cluster.h"
 #include "graph.h"
+#include "feature_extractor.h"
+#include "pose_solver.h"
+#include "bounded_queue.h"
+#include "pair_registry.h"
 
 using namespace std;
 using namespace boost;
@@ -46,24 +50,20 @@ public:
   void run();
 
   /** \brief Add a cluster to the queue of clusters
-   * \param The cluster to be inserted
+   * \param The cluster to be inserted (shared, not copied)
    */
-  void addClusterToQueue(Cluster cluster);
+  void addClusterToQueue(const ClusterPtr& cluster);
 
-  /** \brief Finalizes the loop closing class
+  /** \brief Finalizes the loop closing class: the clusters queue is closed and the thread stops
    */
   void finalize();
 
 protected:
 
-  /** \brief Check if there are clusters in the queue
-   * @return true if clusters queue is not empty.
-   */
-  bool checkNewClusterInQueue();
-
   /** \brief Processes the new cluster
+   * \param the cluster
    */
-  void processNewCluster();
+  void processNewCluster(const ClusterPtr& cluster);
 
   /** \brief Searches a loop closing between current cluster and its closest neighbors
    */
@@ -78,7 +78,7 @@ protected:
    * \param Candidate cluster
    * \param Type of search (proximity or hash)
    */
-  bool closeLoopWithCluster(Cluster candidate, string search_method);
+  bool closeLoopWithCluster(const Cluster& candidate, const string& search_method);
 
   /** \brief Get the best candidates to close a loop by hash
    * \param Cluster identifier
@@ -111,17 +111,15 @@ protected:
 
 private:
 
-  Cluster c_cluster_; //!> Current cluster to be processed
-
-  list<Cluster> cluster_queue_; //!> Clusters queue to be inserted into the graph
+  ClusterPtr c_cluster_; //!> Current cluster to be processed
 
-  mutex mutex_cluster_queue_; //!> Mutex for the insertion of new clusters
+  BoundedQueue<ClusterPtr> cluster_queue_; //!> Clusters queue to be inserted into the graph (unbounded)
 
   haloc::Hash hash_; //!> Hash object
 
   vector< pair<int, vector<float> > > hash_table_;  //!> Hash table: stores a hash for every image. This is the unique variable that grows with the robot trajectory
 
-  vector< pair<int, int > > cluster_lc_found_; //!> Stores all the loop closures (between clusters) found in order to do not repeat them
+  PairRegistry cluster_loop_closings_; //!> Stores all the loop closures (between clusters) found in order to do not repeat them
 
   int num_loop_closures_; //!> Stores the number of loop closures
 
@@ -131,12 +129,16 @@ private:
 
   Graph* graph_; //!> Graph pointer
 
+  PoseSolver pose_solver_; //!> PnP RANSAC solver (loop closing thread)
+
   ros::Publisher pub_num_keyframes_; //!> Publishes the number of keyframes
 
   ros::Publisher pub_num_lc_; //!> Publishes the number of loop closings
 
   ros::Publisher pub_queue_; //!> Publishes the loop closing queue size
 
+  ros::Publisher pub_queue_age_; //!> Publishes the time the oldest queued cluster has been waiting
+
   ros::Publisher pub_matchings_num_; //!> Publishes the image with the loop closure matchings
 
   ros::Publisher pub_inliers_img_, pub_inliers_num_; //!> Publishes the image with the loop closure inliers
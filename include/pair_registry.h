@@ -0,0 +1,119 @@
+/**
+ * @file
+ * @brief The pair registry class stores a value for every unordered pair of ids, with adjacency lists (presentation).
+ */
+
+#ifndef PAIR_REGISTRY_H
+#define PAIR_REGISTRY_H
+
+#include <stdint.h>
+#include <vector>
+#include <unordered_map>
+
+#include <boost/thread.hpp>
+
+using namespace std;
+
+namespace slam
+{
+
+class PairRegistry
+{
+
+public:
+
+  /** \brief Add a value to a pair. The pair is registered the first time.
+   * @return true if the pair was not registered
+   * \param first id
+   * \param second id
+   * \param value to accumulate
+   */
+  bool add(int a, int b, int value = 0)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    pair<unordered_map<uint64_t, int>::iterator, bool> res = values_.insert(make_pair(key(a, b), value));
+    if (!res.second)
+    {
+      res.first->second += value;
+      return false;
+    }
+
+    // New pair
+    if (a >= 0)
+      adjacency(a).push_back(b);
+    if (b >= 0 && a != b)
+      adjacency(b).push_back(a);
+    return true;
+  }
+
+  /** \brief Check if a pair is registered
+   * \param first id
+   * \param second id
+   */
+  bool contains(int a, int b) const
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return values_.count(key(a, b)) > 0;
+  }
+
+  /** \brief Get the accumulated value of a pair
+   * @return the value (0 if the pair is not registered)
+   * \param first id
+   * \param second id
+   */
+  int get(int a, int b) const
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    unordered_map<uint64_t, int>::const_iterator it = values_.find(key(a, b));
+    return it == values_.end() ? 0 : it->second;
+  }
+
+  /** \brief Get the ids paired with an id, in registration order
+   * \param the id
+   * \param output paired ids
+   */
+  void getNeighbors(int a, vector<int>& neighbors) const
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    if (a >= 0 && a < (int)adjacency_.size())
+      neighbors = adjacency_[a];
+    else
+      neighbors.clear();
+  }
+
+  /** \brief Get the number of registered pairs
+   */
+  size_t size() const
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return values_.size();
+  }
+
+private:
+
+  // The key does not depend on the order of the ids
+  static inline uint64_t key(int a, int b)
+  {
+    if (a > b) swap(a, b);
+    return ((uint64_t)(uint32_t)a << 32) | (uint32_t)b;
+  }
+
+  // The ids are dense (frame or vertex ids), so the adjacency lists are indexed by id
+  vector<int>& adjacency(int a)
+  {
+    if (a >= (int)adjacency_.size())
+      adjacency_.resize(a + 1);
+    return adjacency_[a];
+  }
+
+  unordered_map<uint64_t, int> values_; //!> Accumulated value of every pair
+
+  vector< vector<int> > adjacency_; //!> Paired ids of every id
+
+  mutable boost::mutex mutex_; //!> Protects the registry
+
+};
+
+} // namespace
+
+#endif // PAIR_REGISTRY_H
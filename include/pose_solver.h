@@ -0,0 +1,107 @@
+/**
+ * @file
+ * @brief The pose solver class estimates the camera pose from 3D-2D correspondences with RANSAC (presentation).
+ */
+
+#ifndef POSE_SOLVER_H
+#define POSE_SOLVER_H
+
+#include <opencv2/opencv.hpp>
+
+#include "constants.h"
+
+using namespace std;
+
+namespace slam
+{
+
+class PoseSolver
+{
+
+public:
+
+  struct Params
+  {
+    int max_iterations;               //!> Maximum number of RANSAC iterations.
+    double reprojection_error;        //!> Maximum reprojection error (pixels) of an inlier.
+    double confidence;                //!> Probability of having sampled at least one all-inlier set.
+
+    // Default settings
+    Params () {
+      max_iterations     = 100;
+      reprojection_error = LC_EPIPOLAR_THRESH;
+      confidence         = 0.99;
+    }
+  };
+
+  /** \brief Class constructor
+   */
+  PoseSolver();
+
+  /** \brief Set class params
+   * \param the parameters struct
+   */
+  inline void setParams(const Params& params){params_ = params;}
+
+  /** \brief Get class params
+   */
+  inline Params getParams() const {return params_;}
+
+  /** \brief Estimate the pose that projects the 3D points onto the image points.
+   * The hypotheses come from a minimal P3P solver (AP3P when available) on samples drawn PROSAC-like: the
+   * correspondences are sorted by their quality and the sampling pool grows from the best ones. Once the pool
+   * holds all of them the samples are uniform, as in RANSAC. The number of iterations adapts to the inlier
+   * ratio. The best hypothesis is refined with Levenberg-Marquardt
+   * (SOLVEPNP_ITERATIVE) on its inliers and its information matrix is computed from the projection jacobian.
+   * The solver keeps buffers between calls, so every thread must use its own solver.
+   * @return true if a pose with at least 4 inliers was found
+   * \param 3D points
+   * \param image points
+   * \param camera matrix (CV_64F)
+   * \param quality of every correspondence, lower is better (e.g. the descriptor distance). Can be empty.
+   * \param output rotation vector (points to camera)
+   * \param output translation vector (points to camera)
+   * \param output inlier indices
+   * \param output information matrix (6x6, see computeInformation)
+   */
+  bool solve(const vector<cv::Point3f>& points, const vector<cv::Point2f>& kp, const cv::Mat& camera_matrix,
+             const vector<float>& quality, cv::Mat& rvec, cv::Mat& tvec, vector<int>& inliers, cv::Mat& information);
+
+protected:
+
+  /** \brief Score a pose hypothesis: the reprojection of all the points is computed in a branch-free loop
+   * over contiguous coordinate arrays, so the compiler can vectorize it.
+   * @return the number of inliers
+   * \param rotation vector
+   * \param translation vector
+   * \param optional output inlier indices
+   */
+  int score(const cv::Mat& rvec, const cv::Mat& tvec, vector<int>* inliers);
+
+  /** \brief Compute the information matrix J^T*J of a pose with the analytic 2x6 projection jacobian of
+   * every inlier, in a single pass (1 pixel noise). The parameters are a (translation, rotation) perturbation
+   * of the points to camera transform applied on the left, which is the same as a perturbation of the
+   * camera motion (the inverse transform) applied on the right.
+   * \param rotation vector
+   * \param translation vector
+   * \param inlier indices
+   * \param output information matrix (6x6, CV_64F)
+   */
+  void computeInformation(const cv::Mat& rvec, const cv::Mat& tvec, const vector<int>& inliers, cv::Mat& information);
+
+private:
+
+  Params params_; //!> Stores parameters.
+
+  // Correspondences of the current solve call, as contiguous arrays. They are reused between calls.
+  vector<float> x_, y_, z_; //!> 3D points
+  vector<float> u_, v_; //!> Image points
+  vector<uchar> inlier_mask_; //!> Score buffer
+
+  float fx_, fy_, cx_, cy_; //!> Camera matrix of the current solve call
+
+};
+
+} // namespace
+
+#endif // POSE_SOLVER_H
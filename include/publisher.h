@@ -38,24 +38,28 @@ public:
   /** \brief Publish the clustering debug images
    * \param The frame object contains all the information needed to draw the image
    */
-  void publishClustering(const Frame frame);
+  void publishClustering(const Frame& frame);
 
   /** \brief Publish the stereo matching debug image
    * \param The frame object contains all the information needed to draw the image
    */
-  void publishStereoMatches(const Frame frame);
+  void publishStereoMatches(const Frame& frame);
+
+  /** \brief True when some node is subscribed to the stereo matching topics
+   */
+  bool hasStereoMatchesSubscribers() const;
 
 protected:
 
   /** \brief Draw and publish the keypoint clustering
    * \param The frame containing the clustering information
    */
-  void drawKeypointsClustering(const Frame frame);
+  void drawKeypointsClustering(const Frame& frame);
 
   /** \brief Draw and publish the stereo matches
    * \param The frame containing the clustering information
    */
-  void drawStereoMatches(const Frame frame);
+  void drawStereoMatches(const Frame& frame);
 
 private:
 
@@ -13,6 +13,8 @@
 #include <boost/filesystem.hpp>
 #include <g2o/types/slam3d/vertex_se3.h>
 
+#include "top2_matcher.h"
+
 namespace enc = sensor_msgs::image_encodings;
 namespace fs  = boost::filesystem;
 
@@ -122,32 +124,30 @@ public:
     }
   }
 
-  /** \brief Convert image messages to cv cv::Mat
-    * \param left image message.
-    * \param right image message.
-    * \param will contain the output left cv::Mat.
-    * \param will contain the output right cv::Mat.
+  /** \brief Convert an image message to cv::Mat. The message data is shared (not copied) when the
+    * message encoding is the requested one, so the message must be kept alive while the cv::Mat is used.
+    * @return false if the message can not be converted
+    * \param image message.
+    * \param output encoding (e.g. enc::MONO8 or enc::BGR8).
+    * \param will contain the output cv::Mat.
     */
-  static bool imgMsgToMat(sensor_msgs::Image l_img_msg,
-                          sensor_msgs::Image r_img_msg,
-                          cv::Mat &l_img, cv::Mat &r_img)
+  static bool imgMsgToMat(const sensor_msgs::ImageConstPtr& img_msg,
+                          const string& encoding,
+                          cv::Mat &img)
   {
+    img.release();
+    if (!img_msg) return false;
+
     // Convert message to cv::Mat
-    cv_bridge::CvImagePtr l_img_ptr, r_img_ptr;
     try
     {
-      l_img_ptr = cv_bridge::toCvCopy(l_img_msg, enc::BGR8);
-      r_img_ptr = cv_bridge::toCvCopy(r_img_msg, enc::BGR8);
+      img = cv_bridge::toCvShare(img_msg, encoding)->image;
     }
     catch (cv_bridge::Exception& e)
     {
       ROS_ERROR("[StereoSlam:] cv_bridge exception: %s", e.what());
       return false;
     }
-
-    // Set the images
-    l_img = l_img_ptr->image;
-    r_img = r_img_ptr->image;
     return true;
   }
 
@@ -261,6 +261,31 @@ public:
     return tf::Transform(quaternion, translation);
   }
 
+  /** \brief Express the information matrix of a pose perturbation (translation, rotation) applied on
+    * the right of a transform T in the frame of T * transform, i.e. Ad^T * information * Ad, where Ad
+    * is the adjoint of the transform.
+    * @return the transformed information matrix (6x6, CV_64F)
+    * \param information matrix (6x6, CV_64F)
+    * \param the transform
+    */
+  static cv::Mat transformInformation(const cv::Mat& information, const tf::Transform& transform)
+  {
+    // Ad = [R, [p]x * R; 0, R]
+    const tf::Matrix3x3& r = transform.getBasis();
+    const tf::Vector3& p = transform.getOrigin();
+    cv::Mat R = (cv::Mat_<double>(3, 3) << r[0][0], r[0][1], r[0][2],
+                                           r[1][0], r[1][1], r[1][2],
+                                           r[2][0], r[2][1], r[2][2]);
+    cv::Mat P = (cv::Mat_<double>(3, 3) <<    0.0, -p.z(),  p.y(),
+                                            p.z(),    0.0, -p.x(),
+                                           -p.y(),  p.x(),    0.0);
+    cv::Mat ad = cv::Mat::zeros(6, 6, CV_64F);
+    R.copyTo(ad(cv::Rect(0, 0, 3, 3)));
+    cv::Mat(P * R).copyTo(ad(cv::Rect(3, 0, 3, 3)));
+    R.copyTo(ad(cv::Rect(3, 3, 3, 3)));
+    return ad.t() * information * ad;
+  }
+
   static cv::Point3f transformPoint(cv::Point3f point, tf::Transform base)
   {
     tf::Vector3 p_tf(point.x, point.y, point.z);
@@ -269,35 +294,33 @@ public:
     return new_point;
   }
 
+  /** \brief Copy a selection of rows into a new matrix, allocated once
+    * @return the matrix with the selected rows (empty when no row is selected)
+    * \param source matrix
+    * \param indices of the rows to copy
+    * \param number of rows to copy
+    */
+  static cv::Mat selectRows(const cv::Mat& src, const int* idx, int n)
+  {
+    if (n <= 0) return cv::Mat();
+    cv::Mat dst(n, src.cols, src.type());
+    const size_t row_size = src.cols * src.elemSize();
+    for (int i=0; i<n; i++)
+      memcpy(dst.ptr(i), src.ptr(idx[i]), row_size);
+    return dst;
+  }
+
   /** \brief Ration matching between descriptors
     * \param Descriptors of image 1
     * \param Descriptors of image 2
     * \param ratio value (0.6/0.9)
     * \param output matching
     */
-  static void ratioMatching(cv::Mat desc_1, cv::Mat desc_2, double ratio, vector<cv::DMatch> &matches)
+  static void ratioMatching(const cv::Mat& desc_1, const cv::Mat& desc_2, double ratio, vector<cv::DMatch> &matches)
   {
     matches.clear();
     if (desc_1.rows < 10 || desc_2.rows < 10) return;
-
-    assert(desc_1.type() == desc_2.type());
-    assert(desc_1.cols == desc_2.cols);
-
-    cv::Mat match_mask;
-    const int knn = 2;
-    cv::Ptr<cv::DescriptorMatcher> descriptor_matcher;
-    if (desc_1.type() == CV_8U)
-      descriptor_matcher = cv::DescriptorMatcher::create("BruteForce-Hamming");
-    else
-      descriptor_matcher = cv::DescriptorMatcher::create("BruteForce");
-    vector<vector<cv::DMatch> > knn_matches;
-    descriptor_matcher->knnMatch(desc_1, desc_2, knn_matches, knn, match_mask);
-    for (uint m=0; m<knn_matches.size(); m++)
-    {
-      if (knn_matches[m].size() < 2) continue;
-      if (knn_matches[m][0].distance <= knn_matches[m][1].distance * ratio)
-        matches.push_back(knn_matches[m][0]);
-    }
+    slam::Top2Matcher::match(desc_1, desc_2, ratio, matches);
   }
 
   /** \brief match descriptors of 2 images by threshold
@@ -311,86 +334,22 @@ public:
   static void thresholdMatching(const cv::Mat& descriptors1, const cv::Mat& descriptors2,
     double threshold, const cv::Mat& match_mask, vector<cv::DMatch>& matches)
   {
-    matches.clear();
-    if (descriptors1.empty() || descriptors2.empty())
-      return;
-    assert(descriptors1.type() == descriptors2.type());
-    assert(descriptors1.cols == descriptors2.cols);
-
-    const int knn = 2;
-    cv::Ptr<cv::DescriptorMatcher> descriptor_matcher;
-    // choose matcher based on feature type
-    if (descriptors1.type() == CV_8U)
-      descriptor_matcher = cv::DescriptorMatcher::create("BruteForce-Hamming");
-    else
-      descriptor_matcher = cv::DescriptorMatcher::create("BruteForce");
-    vector<vector<cv::DMatch> > knn_matches;
-    descriptor_matcher->knnMatch(descriptors1, descriptors2,
-            knn_matches, knn, match_mask);
-
-    for (size_t m = 0; m < knn_matches.size(); m++)
-    {
-      if (knn_matches[m].size() < 2) continue;
-      float dist1 = knn_matches[m][0].distance;
-      float dist2 = knn_matches[m][1].distance;
-      if (dist1 / dist2 < threshold)
-      {
-        matches.push_back(knn_matches[m][0]);
-      }
-    }
-  }
-
-  /** \brief filter matches of cross check matching
-    * @return
-    * \param matches1to2 matches from image 1 to 2
-    * \param matches2to1 matches from image 2 to 1
-    * \param matches output vector with filtered matches
-    */
-  static void crossCheckFilter(
-      const vector<cv::DMatch>& matches1to2,
-      const vector<cv::DMatch>& matches2to1,
-      vector<cv::DMatch>& checked_matches)
-  {
-    checked_matches.clear();
-    for (size_t i = 0; i < matches1to2.size(); ++i)
-    {
-      bool match_found = false;
-      const cv::DMatch& forward_match = matches1to2[i];
-      for (size_t j = 0; j < matches2to1.size() && match_found == false; ++j)
-      {
-        const cv::DMatch& backward_match = matches2to1[j];
-        if (forward_match.trainIdx == backward_match.queryIdx &&
-            forward_match.queryIdx == backward_match.trainIdx)
-        {
-          checked_matches.push_back(forward_match);
-          match_found = true;
-        }
-      }
-    }
+    slam::Top2Matcher::match(descriptors1, descriptors2, threshold, matches, false, true, match_mask);
   }
 
-  /** \brief match descriptors of 2 images by threshold
+  /** \brief match descriptors of 2 images by threshold, in both directions (cross check)
     * @return
     * \param descriptors1 descriptors of image 1
     * \param descriptors2 descriptors of image 2
     * \param threshold to determine correct matchings
-    * \param match_mask mask for matchings
     * \param matches output vector with the matches
     */
   static void crossCheckThresholdMatching(
     const cv::Mat& descriptors1, const cv::Mat& descriptors2,
     double threshold, vector<cv::DMatch>& matches)
   {
-    const cv::Mat match_mask;
-
-    vector<cv::DMatch> query_to_train_matches;
-    thresholdMatching(descriptors1, descriptors2, threshold, match_mask, query_to_train_matches);
-    vector<cv::DMatch> train_to_query_matches;
-    cv::Mat match_mask_t;
-    if (!match_mask.empty()) match_mask_t = match_mask.t();
-    thresholdMatching(descriptors2, descriptors1, threshold, match_mask_t, train_to_query_matches);
-
-    crossCheckFilter(query_to_train_matches, train_to_query_matches, matches);
+    // Both directions pass the ratio test in a single call
+    slam::Top2Matcher::match(descriptors1, descriptors2, threshold, matches, true, true);
   }
 
   static string convertTo5digits(int in)
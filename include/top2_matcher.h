@@ -0,0 +1,137 @@
+/**
+ * @file
+ * @brief The top-2 matcher class searches the two nearest descriptors of every query descriptor (presentation).
+ */
+
+#ifndef TOP2_MATCHER_H
+#define TOP2_MATCHER_H
+
+#include <stdint.h>
+#include <string.h>
+#include <cmath>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#include <opencv2/opencv.hpp>
+
+using namespace std;
+
+namespace slam
+{
+
+/** \brief Squared L2 distance between floating point descriptors
+ */
+struct L2Squared
+{
+  typedef float ElementType;
+  typedef float ResultType;
+
+  static inline ResultType distance(const float* a, const float* b, int n)
+  {
+    int i = 0;
+    float sum = 0.0;
+#if defined(__AVX512F__)
+    __m512 acc512 = _mm512_setzero_ps();
+    for (; i+16<=n; i+=16)
+    {
+      __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+      acc512 = _mm512_fmadd_ps(d, d, acc512);
+    }
+    sum += _mm512_reduce_add_ps(acc512);
+#endif
+#ifdef __AVX2__
+    __m256 acc = _mm256_setzero_ps();
+    for (; i+8<=n; i+=8)
+    {
+      __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+      acc = _mm256_add_ps(acc, _mm256_mul_ps(d, d));
+    }
+    __m128 acc4 = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    acc4 = _mm_hadd_ps(acc4, acc4);
+    acc4 = _mm_hadd_ps(acc4, acc4);
+    sum += _mm_cvtss_f32(acc4);
+#endif
+    for (; i<n; i++)
+    {
+      float d = a[i] - b[i];
+      sum += d * d;
+    }
+    return sum;
+  }
+
+  // The ratio test is applied on the squared distances
+  static inline ResultType toSquared(double v) {return (ResultType)(v * v);}
+
+  static inline float toDistance(ResultType d) {return sqrt(d);}
+};
+
+/** \brief Hamming distance between binary descriptors
+ */
+struct Hamming
+{
+  typedef uchar ElementType;
+  typedef int ResultType;
+
+  static inline ResultType distance(const uchar* a, const uchar* b, int n)
+  {
+    int i = 0;
+    int sum = 0;
+    for (; i+8<=n; i+=8)
+    {
+      uint64_t va, vb;
+      memcpy(&va, a + i, 8);
+      memcpy(&vb, b + i, 8);
+      sum += __builtin_popcountll(va ^ vb);
+    }
+    for (; i<n; i++)
+      sum += __builtin_popcount(a[i] ^ b[i]);
+    return sum;
+  }
+
+  static inline double toSquared(double v) {return v;}
+
+  static inline float toDistance(ResultType d) {return (float)d;}
+};
+
+class Top2Matcher
+{
+
+public:
+
+  /** \brief Match every descriptor of desc_1 with its nearest descriptor of desc_2 when it passes the ratio test
+   * (best <= ratio * second best). Binary (CV_8U) descriptors use the Hamming distance and floating point
+   * (CV_32F) descriptors the L2 distance. The query rows are processed in parallel.
+   * \param query descriptors
+   * \param train descriptors (same type and size as the query descriptors)
+   * \param ratio value (0.6/0.9)
+   * \param output matching (distances in the descriptor metric)
+   * \param keep only the matches where the query is also the nearest descriptor of its train descriptor, and
+   * that nearest query passes the same ratio test against the second nearest query (two-sided matching)
+   * \param use a strict ratio test (best < ratio * second best)
+   * \param optional mask (CV_8U, query rows x train rows), only non-zero pairs are compared
+   */
+  static void match(const cv::Mat& desc_1, const cv::Mat& desc_2, double ratio, vector<cv::DMatch>& matches,
+                    bool cross_check=false, bool strict=false, const cv::Mat& mask=cv::Mat());
+
+  /** \brief Distance between two descriptors
+   * @return the Hamming distance for CV_8U descriptors, the L2 distance otherwise
+   * \param first descriptor matrix
+   * \param row of the first descriptor
+   * \param second descriptor matrix
+   * \param row of the second descriptor
+   */
+  static inline float distance(const cv::Mat& desc_1, int row_1, const cv::Mat& desc_2, int row_2)
+  {
+    if (desc_1.type() == CV_8U)
+      return Hamming::distance(desc_1.ptr<uchar>(row_1), desc_2.ptr<uchar>(row_2), desc_1.cols);
+    else
+      return sqrt(L2Squared::distance(desc_1.ptr<float>(row_1), desc_2.ptr<float>(row_2), desc_1.cols));
+  }
+
+};
+
+} // namespace
+
+#endif // TOP2_MATCHER_H
@@ -18,13 +18,14 @@
 #include <tf/transform_listener.h>
 #include <tf/transform_broadcaster.h>
 
+#include <cfloat>
+
 #include <pcl_ros/point_cloud.h>
 #include <pcl_ros/transforms.h>
 #include <pcl/point_types.h>
 #include <pcl/common/common.h>
 #include <pcl/filters/filter.h>
 #include <pcl/filters/approximate_voxel_grid.h>
-#include <pcl/filters/crop_box.h>
 
 #include <opencv2/opencv.hpp>
 
@@ -32,8 +33,12 @@
 #include <boost/lexical_cast.hpp>
 
 #include "frame.h"
+#include "keyframe.h"
+#include "feature_extractor.h"
 #include "graph.h"
 #include "publisher.h"
+#include "bounded_queue.h"
+#include "pose_solver.h"
 
 using namespace std;
 using namespace boost;
@@ -60,15 +65,57 @@ public:
     string odom_topic;                //!> Odometry topic name.
     string camera_topic;              //!> Name of the base camera topic.
     bool refine;                      //!> Refine odometry
+    bool mono_images;                 //!> Subscribe to the mono image_rect topics instead of image_rect_color
+    int overlap_stride;               //!> Use one of every overlap_stride cloud points to estimate the overlap
 
     // Default settings
     Params () {
       odom_topic   = "/odom";
       camera_topic = "/usb_cam";
       refine = false;
+      mono_images = false;
+      overlap_stride = 1;
     }
   };
 
+  /** \brief Synchronized messages of a frame
+   */
+  struct FrameMsgs
+  {
+    nav_msgs::Odometry::ConstPtr odom_msg;
+    sensor_msgs::ImageConstPtr l_img_msg;
+    sensor_msgs::ImageConstPtr r_img_msg;
+    sensor_msgs::CameraInfoConstPtr l_info_msg;
+    sensor_msgs::CameraInfoConstPtr r_info_msg;
+    sensor_msgs::PointCloud2ConstPtr cloud_msg;
+  };
+
+  /** \brief A frame with its features and filtered cloud, ready for the pose estimation
+   */
+  struct TrackedFrame
+  {
+    nav_msgs::Odometry::ConstPtr odom_msg;
+    FramePtr frame;
+  };
+
+  /** \brief A new keyframe to be stored and sent to the graph
+   */
+  struct NewKeyFrame
+  {
+    FramePtr frame;
+    KeyFramePtr keyframe;
+  };
+
+  /** \brief Result of a pointcloud scan
+   */
+  struct CloudScan
+  {
+    int num_points;           //!> Number of scanned finite points
+    int num_inside;           //!> Number of scanned points inside the last keyframe bounds, once transformed
+    Eigen::Vector4f min_pt;   //!> Minimum coordinates of the scanned points (not transformed)
+    Eigen::Vector4f max_pt;   //!> Maximum coordinates of the scanned points (not transformed)
+  };
+
   enum trackingState{
     NOT_INITIALIZED   = 0,
     INITIALIZING      = 1,
@@ -79,8 +126,9 @@ public:
   /** \brief Class constructor
    * \param Frame publisher object pointer
    * \param Graph object pointer
+   * \param Feature extractor object pointer
    */
-  Tracking(Publisher* f_pub, Graph* graph);
+  Tracking(Publisher* f_pub, Graph* graph, FeatureExtractor* feature_extractor);
 
   /** \brief Set class params
    * \param the parameters struct
@@ -93,16 +141,19 @@ public:
 
   /** \brief Get current frame
    */
-  inline Frame getCurrentFrame() const {return c_frame_;}
+  inline const Frame& getCurrentFrame() const {return *c_frame_;}
 
-  /** \brief Starts tracking
+  /** \brief Starts tracking. The tracking runs as a pipeline of threads connected by bounded queues:
+   * the messages callback queues the synchronized messages, the features thread builds the frames
+   * (image conversion, feature extraction and cloud filtering), the pose thread estimates the frame
+   * pose and decides the keyframes, and the keyframe thread stores and publishes the new keyframes.
    */
   void run();
 
 protected:
 
   /** \brief Messages callback. This function is called when synchronized odometry and image
-   * message are received.
+   * message are received. The messages are queued for the features thread.
    * \param odom_msg ros odometry message of type nav_msgs::Odometry
    * \param l_img left stereo image message of type sensor_msgs::Image
    * \param r_img right stereo image message of type sensor_msgs::Image
@@ -117,6 +168,23 @@ protected:
                     const sensor_msgs::CameraInfoConstPtr& r_info_msg,
                     const sensor_msgs::PointCloud2ConstPtr& cloud_msg);
 
+  /** \brief Features thread: builds the frames from the queued messages
+   */
+  void featuresThread();
+
+  /** \brief Pose thread: estimates the pose of the queued frames
+   */
+  void poseThread();
+
+  /** \brief Keyframe thread: stores and publishes the queued keyframes
+   */
+  void keyFrameThread();
+
+  /** \brief Estimate the pose of a frame, decide if it is a new keyframe and publish the pose
+   * \param the frame with its odometry
+   */
+  void processFrame(const TrackedFrame& tracked_frame);
+
   /** \brief Get the transform between odometry frame and camera frame
    * @return true if valid transform, false otherwise
    * \param Odometry msg
@@ -132,11 +200,16 @@ protected:
    */
   bool needNewKeyFrame();
 
-  /** \brief Add a frame to the graph if enough inliers
+  /** \brief Add a frame to the graph if enough inliers. The keyframe is stored by the keyframe thread.
    * @return True if new keyframe will be inserted into the map
    */
   bool addFrameToMap();
 
+  /** \brief Send a new keyframe to the graph, save and publish its pointcloud
+   * \param the new keyframe
+   */
+  void storeKeyFrame(const NewKeyFrame& new_keyframe);
+
 
   /** \brief Filters a pointcloud
    * @return filtered cloud
@@ -144,23 +217,60 @@ protected:
    */
   PointCloudRGB::Ptr filterCloud(PointCloudRGB::Ptr in_cloud);
 
+  /** \brief Scan the points of a pointcloud message in a single pass, directly from the message buffer:
+   * counts the finite points, computes their bounds and counts the points that fall inside the last
+   * keyframe bounds (last_min_pt_, last_max_pt_) once transformed.
+   * @return false if the message has no float x, y, z fields
+   * \param pointcloud message
+   * \param transformation applied to the points before the bounds test
+   * \param scan one of every stride points
+   * \param output scan result
+   */
+  bool scanCloud(const sensor_msgs::PointCloud2& cloud_msg, const tf::Transform& movement, int stride, CloudScan& scan) const;
+
+  /** \brief Apply the safety factor to an overlap estimation
+   * @return the corrected overlap
+   * \param the overlap (percentage)
+   */
+  inline static float overlapWithSafetyFactor(float overlap) {return (0.002 * overlap + 0.8) * overlap;}
+
   /** \brief Publishes the overlapping debug image
    * @return
-   * \param current pointcloud
+   * \param scan of the current pointcloud
    * \param the transformation of current pointcloud to the last fixed frame
    * \param the overlap
    */
-  void publishOverlap(PointCloudXYZ::Ptr cloud, tf::Transform movement, float overlap);
+  void publishOverlap(const CloudScan& scan, tf::Transform movement, float overlap);
+
+  /** \brief Refine the keyframe to keyframe position using SolvePnP. The previous keyframe 3D points are
+   * projected into the current image with the predicted motion and matched with the current keypoints
+   * inside a window of TRACKING_SEARCH_RADIUS pixels. A match needs two keypoints inside the window to pass
+   * the ratio test, and every current keypoint is matched at most once (with the closest descriptor).
+   * @return True if a valid transform was found
+   * \param previous keyframe
+   * \param current frame
+   * \param predicted transform (odometry) between the previous keyframe and the current frame
+   * \param the estimated transform
+   * \param information matrix of the transformation
+   * \param number of inliers for the refined pose
+   */
+  bool refinePose(const KeyFramePtr& query, const Frame& candidate, const tf::Transform& prediction,
+                  tf::Transform& out, cv::Mat& information, int& num_inliers);
+
+  /** \brief Start tracking the keypoints of the current frame, a new keyframe, with optical flow
+   */
+  void resetTracks();
 
-  /** \brief Refine the keyframe to keyframe position using SolvePnP
+  /** \brief Refine the keyframe to frame position following the keyframe keypoints with pyramidal
+   * Lucas-Kanade optical flow from the last tracked frame, and using SolvePnP with the keyframe 3D points.
+   * The tracks are dropped when the pose can not be estimated.
    * @return True if a valid transform was found
    * \param current frame
-   * \param previous frame
    * \param the estimated transform
-   * \param covariance of the transformation
+   * \param information matrix of the transformation
    * \param number of inliers for the refined pose
    */
-  bool refinePose(Frame c_frame, Frame p_frame, tf::Transform& out, cv::Mat& sigma, int& num_inliers);
+  bool trackPose(const FramePtr& frame, tf::Transform& out, cv::Mat& information, int& num_inliers);
 
 private:
 
@@ -172,9 +282,17 @@ private:
 
   tf::TransformListener tf_listener_; //!> Listen for tf between robot and camera.
 
-  Frame c_frame_; //!> Current frame
+  FramePtr c_frame_; //!> Current frame (pose thread)
+
+  KeyFramePtr p_frame_; //!> Previous keyframe, shared with the graph
+
+  FramePtr track_frame_; //!> Last frame tracked with optical flow (reference image of the tracks)
+
+  vector<cv::Point2f> track_kp_; //!> Position of the tracked keypoints in track_frame_
 
-  Frame p_frame_; //!> Previous frame
+  vector<cv::Point3f> track_points_; //!> 3D points of the tracked keypoints, in the previous keyframe camera frame
+
+  PoseSolver pose_solver_; //!> PnP RANSAC solver (pose thread)
 
   cv::Mat camera_matrix_; //!> Camera matrix
 
@@ -190,8 +308,12 @@ private:
 
   image_geometry::StereoCameraModel camera_model_; //!> Stereo camera model
 
+  bool camera_model_ready_; //!> True when the camera model has been set (features thread)
+
   Graph* graph_; //!> Graph
 
+  FeatureExtractor* feature_extractor_; //!> Feature extractor
+
   tf::Transform last_fixed_frame_pose_; //!> Stores the last fixed frame pose
 
   Eigen::Vector4f last_min_pt_, last_max_pt_; // Stores the last fixed frame minimum and maximum points
@@ -208,6 +330,12 @@ private:
 
   double secs_to_filter_; //!> Number of seconds that filter will be applied
 
+  BoundedQueue<FrameMsgs> msgs_queue_; //!> Messages callback -> features thread
+
+  BoundedQueue<TrackedFrame> frames_queue_; //!> Features thread -> pose thread
+
+  BoundedQueue<NewKeyFrame> keyframes_queue_; //!> Pose thread -> keyframe thread
+
   // Topic sync
   typedef message_filters::sync_policies::ApproximateTime<nav_msgs::Odometry,
                                                           sensor_msgs::Image,
@@ -16,7 +16,6 @@ import tf.transformations as tf
 from scipy.misc import imread
 
 # Global variables
-lock_file = ""
 graph_edges_file = ""
 legend_edited = False
 ax_gt = None
@@ -49,7 +48,7 @@ def rm_ax(ax_id):
 def real_time_plot(gt_file, odom_file, graph_vertices_file):
   """ Function to plot the data saved into the files in real time """
 
-  global lock_file, legend_edited, ax_gt, ax_odom, ax_vertices, edges_shown, gt_data, plot_dim
+  global legend_edited, ax_gt, ax_odom, ax_vertices, edges_shown, gt_data, plot_dim
 
   # Remove the main axes
   rm_ax(ax_gt)
@@ -96,11 +95,7 @@ def real_time_plot(gt_file, odom_file, graph_vertices_file):
   # Load stereo slam vertices (file saved with node stereo_slam)
   if (graph_vertices_file != "" and os.path.exists(graph_vertices_file) and check_file_len(graph_vertices_file)):
 
-    # Check if file is blocked
-    while (os.path.exists(lock_file)):
-      time.sleep(0.5)
-
-    # Read the data
+    # Read the data (the file is replaced atomically or appended by whole lines)
     try:
       data = pylab.loadtxt(graph_vertices_file, delimiter=',', skiprows=1, usecols=(2,3,4,5,6,7,8))
     except:
@@ -130,7 +125,7 @@ def real_time_plot(gt_file, odom_file, graph_vertices_file):
 
 def draw_edges():
   """ Draw the edges """
-  global lock_file, graph_edges_file, ax_edges, edges_shown, plot_dim
+  global graph_edges_file, ax_edges, edges_shown, plot_dim
 
   # First, remove previous edges
   remove_edges()
@@ -138,13 +133,9 @@ def draw_edges():
   # Load stereo slam edges (file saved with node stereo_slam)
   if (graph_edges_file != "" and os.path.exists(graph_edges_file) and check_file_len(graph_edges_file)):
 
-    # Check if file is blocked
-    while (os.path.exists(lock_file)):
-      time.sleep(0.5)
-
-    # Read the data
+    # Read the data (the file is replaced atomically)
     try:
-      data = pylab.loadtxt(graph_edges_file, delimiter=',', skiprows=0, usecols=(0,1,2,3,4,5,10,11,12))
+      data = pylab.loadtxt(graph_edges_file, delimiter=',', skiprows=1, usecols=(0,1,2,3,4,5,10,11,12))
     except:
       return;
 
@@ -281,9 +272,6 @@ if __name__ == "__main__":
   if not os.path.exists(ground_truth_file):
     ground_truth_file = "none"
 
-  # Save blocking file into global
-  lock_file = os.path.dirname(graph_vertices_file) + "/graph.lock"
-
   # Init figure
   fig = pylab.figure(1)
   if (plot_dim == 3):
@@ -0,0 +1,286 @@
+#include <ros/ros.h>
+#include <boost/thread.hpp>
+#include <cfloat>
+
+#include "feature_extractor.h"
+#include "constants.h"
+#include "tools.h"
+#include "top2_matcher.h"
+
+using namespace tools;
+
+namespace slam
+{
+
+  // Extract the keypoints and descriptors of a grayscale image at the given scale.
+  // The keypoints are mapped back to full resolution pixel coordinates.
+  // The scale space is built once (detectAndCompute) and bounded keypoints are culled afterwards.
+  static void extractFeatures(cv::Ptr<cv::Feature2D> detector, const cv::Mat& img, double scale, int max_keypoints,
+                              vector<cv::KeyPoint>* kp, cv::Mat* desc)
+  {
+    cv::Mat img_scaled = img;
+    if (scale < 1.0)
+      cv::resize(img, img_scaled, cv::Size(), scale, scale, cv::INTER_AREA);
+
+    detector->detectAndCompute(img_scaled, cv::noArray(), *kp, *desc);
+    FeatureExtractor::retainBest(*kp, img_scaled.size(), max_keypoints, desc);
+
+    if (scale >= 1.0) return;
+
+    const float inv_scale = 1.0 / scale;
+    for (uint i=0; i<kp->size(); i++)
+    {
+      cv::KeyPoint& k = (*kp)[i];
+      k.pt.x = (k.pt.x + 0.5f) * inv_scale - 0.5f;
+      k.pt.y = (k.pt.y + 0.5f) * inv_scale - 0.5f;
+      k.size *= inv_scale;
+    }
+  }
+
+  FeatureExtractor::FeatureExtractor() : job_img_(NULL), job_kp_(NULL), job_desc_(NULL), job_pending_(false), stop_(false)
+  {
+    setParams(params_);
+    worker_ = boost::thread(&FeatureExtractor::workerThread, this);
+  }
+
+  FeatureExtractor::~FeatureExtractor()
+  {
+    {
+      boost::mutex::scoped_lock lock(mutex_worker_);
+      stop_ = true;
+    }
+    worker_cond_.notify_all();
+    worker_.join();
+  }
+
+  void FeatureExtractor::workerThread()
+  {
+    boost::mutex::scoped_lock lock(mutex_worker_);
+    while (true)
+    {
+      while (!job_pending_ && !stop_)
+        worker_cond_.wait(lock);
+      if (stop_) return;
+
+      // The detector and the params do not change while extract waits for the job
+      lock.unlock();
+      try
+      {
+        extractFeatures(r_detector_, *job_img_, params_.scale, params_.max_keypoints, job_kp_, job_desc_);
+      }
+      catch (cv::Exception& e)
+      {
+        ROS_ERROR_STREAM("[Localization:] Right image feature extraction failed: " << e.what());
+        job_kp_->clear();
+        *job_desc_ = cv::Mat();
+      }
+      lock.lock();
+
+      job_pending_ = false;
+      worker_cond_.notify_all();
+    }
+  }
+
+  void FeatureExtractor::setParams(const Params& params)
+  {
+    boost::mutex::scoped_lock lock(mutex_extract_);
+    params_ = params;
+    if (params_.type != "SIFT" && params_.type != "ORB" && params_.type != "AKAZE")
+    {
+      ROS_WARN_STREAM("[Localization:] Unknown feature type " << params_.type << ", using SIFT.");
+      params_.type = "SIFT";
+    }
+    if (params_.max_keypoints < 0)
+      params_.max_keypoints = 0;
+    if (params_.scale <= 0.0 || params_.scale > 1.0)
+    {
+      ROS_WARN_STREAM("[Localization:] Invalid feature scale " << params_.scale << ", using 1.0.");
+      params_.scale = 1.0;
+    }
+
+    // Every image side has its own detector, so they can run concurrently
+    l_detector_ = createDetector();
+    r_detector_ = createDetector();
+  }
+
+  cv::Ptr<cv::Feature2D> FeatureExtractor::createDetector()
+  {
+    if (params_.type == "ORB")
+      return cv::ORB::create(1500, 1.2, 8, 10, 0, 2, cv::ORB::HARRIS_SCORE, 10);
+    else if (params_.type == "AKAZE")
+      return cv::AKAZE::create();
+    else
+      return cv::xfeatures2d::SIFT::create();
+  }
+
+  void FeatureExtractor::retainBest(vector<cv::KeyPoint>& kp, const cv::Size& img_size, int max_keypoints, cv::Mat* desc)
+  {
+    if (max_keypoints <= 0 || (int)kp.size() <= max_keypoints) return;
+
+    // Rank every keypoint inside its grid cell (0 is the strongest of the cell)
+    const float cell_w = max(1.0f, (float)img_size.width / KP_GRID_COLS);
+    const float cell_h = max(1.0f, (float)img_size.height / KP_GRID_ROWS);
+    vector< vector<int> > cells(KP_GRID_COLS * KP_GRID_ROWS);
+    for (uint i=0; i<kp.size(); i++)
+    {
+      int col = min(KP_GRID_COLS - 1, max(0, (int)(kp[i].pt.x / cell_w)));
+      int row = min(KP_GRID_ROWS - 1, max(0, (int)(kp[i].pt.y / cell_h)));
+      cells[row * KP_GRID_COLS + col].push_back(i);
+    }
+
+    // Sort key: rank inside the cell, then response (strongest first), then index
+    vector< pair< pair<int,float>, int > > order;
+    order.reserve(kp.size());
+    for (uint c=0; c<cells.size(); c++)
+    {
+      vector< pair<float,int> > cell;
+      cell.reserve(cells[c].size());
+      for (uint j=0; j<cells[c].size(); j++)
+        cell.push_back(make_pair(-kp[cells[c][j]].response, cells[c][j]));
+      sort(cell.begin(), cell.end());
+      for (uint j=0; j<cell.size(); j++)
+        order.push_back(make_pair(make_pair((int)j, cell[j].first), cell[j].second));
+    }
+    nth_element(order.begin(), order.begin() + max_keypoints, order.end());
+
+    vector<bool> keep(kp.size(), false);
+    for (int i=0; i<max_keypoints; i++)
+      keep[order[i].second] = true;
+
+    vector<cv::KeyPoint> retained;
+    retained.reserve(max_keypoints);
+    cv::Mat retained_desc;
+    const bool has_desc = desc && desc->rows == (int)kp.size();
+    if (has_desc)
+      retained_desc.create(max_keypoints, desc->cols, desc->type());
+    for (uint i=0; i<kp.size(); i++)
+    {
+      if (!keep[i]) continue;
+      if (has_desc)
+        desc->row(i).copyTo(retained_desc.row(retained.size()));
+      retained.push_back(kp[i]);
+    }
+    kp.swap(retained);
+    if (has_desc)
+      *desc = retained_desc;
+  }
+
+  cv::Mat FeatureExtractor::toFloatDescriptors(const cv::Mat& desc)
+  {
+    if (desc.type() != CV_8U)
+      return desc;
+
+    cv::Mat out(desc.rows, desc.cols * 8, CV_32F);
+    for (int i=0; i<desc.rows; i++)
+    {
+      const uchar* in_row = desc.ptr<uchar>(i);
+      float* out_row = out.ptr<float>(i);
+      for (int j=0; j<desc.cols; j++)
+      {
+        for (int b=0; b<8; b++)
+          out_row[8*j + b] = (in_row[j] >> b) & 1;
+      }
+    }
+    return out;
+  }
+
+  void FeatureExtractor::extract(const cv::Mat& l_img, const cv::Mat& r_img,
+                                 vector<cv::KeyPoint>& l_kp, vector<cv::KeyPoint>& r_kp,
+                                 cv::Mat& l_desc, cv::Mat& r_desc)
+  {
+    // The detectors are shared by all the callers
+    boost::mutex::scoped_lock lock(mutex_extract_);
+
+    // The right image is processed in the worker thread while the left one is processed in this thread
+    {
+      boost::mutex::scoped_lock lock(mutex_worker_);
+      job_img_ = &r_img;
+      job_kp_ = &r_kp;
+      job_desc_ = &r_desc;
+      job_pending_ = true;
+    }
+    worker_cond_.notify_all();
+
+    try
+    {
+      extractFeatures(l_detector_, l_img, params_.scale, params_.max_keypoints, &l_kp, &l_desc);
+    }
+    catch (...)
+    {
+      // The worker writes into the caller outputs: wait for it before leaving
+      boost::mutex::scoped_lock lock_worker(mutex_worker_);
+      while (job_pending_)
+        worker_cond_.wait(lock_worker);
+      throw;
+    }
+
+    boost::mutex::scoped_lock lock_worker(mutex_worker_);
+    while (job_pending_)
+      worker_cond_.wait(lock_worker);
+  }
+
+  void FeatureExtractor::ratioMatching(const cv::Mat& desc_1, const cv::Mat& desc_2, double ratio, vector<cv::DMatch>& matches) const
+  {
+    Tools::ratioMatching(desc_1, desc_2, ratio, matches);
+  }
+
+  void FeatureExtractor::stereoMatching(const vector<cv::KeyPoint>& l_kp, const vector<cv::KeyPoint>& r_kp,
+                                        const cv::Mat& l_desc, const cv::Mat& r_desc,
+                                        double ratio, vector<cv::DMatch>& matches) const
+  {
+    matches.clear();
+    if (l_kp.empty() || r_kp.empty()) return;
+
+    // Index the right keypoints by image row. Every row is sorted by column.
+    int max_row = 0;
+    for (uint i=0; i<r_kp.size(); i++)
+      max_row = max(max_row, (int)r_kp[i].pt.y);
+    vector< vector< pair<float,int> > > rows(max_row + 1);
+    for (uint i=0; i<r_kp.size(); i++)
+      rows[(int)r_kp[i].pt.y].push_back(make_pair(r_kp[i].pt.x, (int)i));
+    for (uint i=0; i<rows.size(); i++)
+      sort(rows[i].begin(), rows[i].end());
+
+    // The keypoint localization error grows when the features are extracted on a downscaled image
+    const float epipolar_thresh = STEREO_EPIPOLAR_THRESH / params_.scale;
+    for (uint i=0; i<l_kp.size(); i++)
+    {
+      const cv::Point2f& l_pt = l_kp[i].pt;
+      int row_min = max(0, (int)floor(l_pt.y - epipolar_thresh));
+      int row_max = min(max_row, (int)floor(l_pt.y + epipolar_thresh));
+
+      // Search the two best candidates with positive disparity inside the epipolar band
+      int best_idx = -1;
+      float best_dist = FLT_MAX;
+      float second_dist = FLT_MAX;
+      for (int r=row_min; r<=row_max; r++)
+      {
+        const vector< pair<float,int> >& row = rows[r];
+        vector< pair<float,int> >::const_iterator it;
+        it = lower_bound(row.begin(), row.end(), make_pair(l_pt.x - STEREO_MAX_DISPARITY, -1));
+        for (; it!=row.end() && it->first < l_pt.x; ++it)
+        {
+          int j = it->second;
+          if (abs(r_kp[j].pt.y - l_pt.y) >= epipolar_thresh) continue;
+
+          float dist = Top2Matcher::distance(l_desc, i, r_desc, j);
+          if (dist < best_dist)
+          {
+            second_dist = best_dist;
+            best_dist = dist;
+            best_idx = j;
+          }
+          else if (dist < second_dist)
+          {
+            second_dist = dist;
+          }
+        }
+      }
+
+      // A keypoint without a second candidate can not pass the ratio test
+      if (best_idx >= 0 && second_dist < FLT_MAX && best_dist <= second_dist * ratio)
+        matches.push_back(cv::DMatch(i, best_idx, best_dist));
+    }
+  }
+
+} //namespace slam
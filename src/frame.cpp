@@ -9,65 +9,56 @@ using namespace tools;
 namespace slam
 {
 
-  Frame::Frame() : pointcloud_(new PointCloudRGB) {}
+  Frame::Frame() : has_features_(false), feature_extractor_(NULL) {}
 
-  Frame::Frame(cv::Mat l_img,
-               cv::Mat r_img,
-               image_geometry::StereoCameraModel camera_model,
-               double timestamp) : pointcloud_(new PointCloudRGB)
+  Frame::Frame(const sensor_msgs::ImageConstPtr& l_img_msg,
+               const sensor_msgs::ImageConstPtr& r_img_msg,
+               const image_geometry::StereoCameraModel& camera_model,
+               double timestamp,
+               FeatureExtractor* feature_extractor)
   {
     // Init
     id_ = -1;
+    has_features_ = false;
+    camera_model_ = camera_model;
+    feature_extractor_ = feature_extractor;
     stamp_ = timestamp;
     num_inliers_with_prev_frame_ = 0;
-    sigma_with_prev_frame_ = cv::Mat::eye(6, 6, CV_64F);
+    information_with_prev_frame_ = cv::Mat::eye(6, 6, CV_64F);
+    l_img_msg_ = l_img_msg;
+    r_img_msg_ = r_img_msg;
+  }
 
-    l_img.copyTo(l_img_);
-    r_img.copyTo(r_img_);
+  void Frame::computeFeatures()
+  {
+    if (has_features_ || !feature_extractor_) return;
+    has_features_ = true;
 
-    // Convert images to grayscale
-    cv::Mat l_img_gray, r_img_gray;
-    cv::cvtColor(l_img, l_img_gray, CV_RGB2GRAY);
-    cv::cvtColor(r_img, r_img_gray, CV_RGB2GRAY);
+    if (!decodeImages())
+      return;
 
-    // Keypoints and descriptors
+    // Keypoints and descriptors. The keypoints are extracted directly into
+    // the non-filtered keypoint members.
     cv::Mat l_desc, r_desc;
-    vector<cv::KeyPoint> l_kp, r_kp;
-
-    // ORB from Opencv
-    // cv::Ptr<cv::Feature2D> orb;
-    // orb = cv::ORB::create(1500, 1.2, 8, 10, 0, 2, cv::ORB::HARRIS_SCORE, 10);
-    // orb->detectAndCompute (l_img_gray, cv::noArray(), l_kp, l_desc);
-    // orb->detectAndCompute (r_img_gray, cv::noArray(), r_kp, r_desc);
-
-    // SIFT
-    cv::Ptr<cv::Feature2D> sift;
-    sift = cv::xfeatures2d::SIFT::create();
-    sift->detectAndCompute(l_img_gray, cv::noArray(), l_kp, l_desc);
-    sift->detectAndCompute(r_img_gray, cv::noArray(), r_kp, r_desc);
-
-    // Stores non-filtered keypoints
-    l_nonfiltered_kp_ = l_kp;
-    r_nonfiltered_kp_ = r_kp;
-
-    // Left/right matching
-    vector<cv::DMatch> matches;
-    Tools::ratioMatching(l_desc, r_desc, 0.8, matches);
-
-    // Filter matches by epipolar+
-    matches_filtered_.clear();
-    for (size_t i=0; i<matches.size(); ++i)
-    {
-      if (abs(l_kp[matches[i].queryIdx].pt.y - r_kp[matches[i].trainIdx].pt.y) < STEREO_EPIPOLAR_THRESH)
-        matches_filtered_.push_back(matches[i]);
-    }
+    const vector<cv::KeyPoint>& l_kp = l_nonfiltered_kp_;
+    const vector<cv::KeyPoint>& r_kp = r_nonfiltered_kp_;
+
+    // Extract the features of both images
+    feature_extractor_->extract(l_img_gray_, r_img_gray_, l_nonfiltered_kp_, r_nonfiltered_kp_, l_desc, r_desc);
+
+    // Left/right matching along the epipolar lines
+    feature_extractor_->stereoMatching(l_kp, r_kp, l_desc, r_desc, 0.8, matches_filtered_);
 
-    // Compute 3D points
+    // Compute 3D points. The descriptors of the valid points are copied once at the end.
     l_kp_.clear();
     r_kp_.clear();
     camera_points_.clear();
-    l_desc_.release();
-    r_desc_.release();
+    l_kp_.reserve(matches_filtered_.size());
+    r_kp_.reserve(matches_filtered_.size());
+    camera_points_.reserve(matches_filtered_.size());
+    vector<int> l_valid, r_valid;
+    l_valid.reserve(matches_filtered_.size());
+    r_valid.reserve(matches_filtered_.size());
     for (size_t i=0; i<matches_filtered_.size(); ++i)
     {
       cv::Point3d world_point;
@@ -78,37 +69,50 @@ namespace slam
       cv::Point2d r_point = r_kp[r_idx].pt;
 
       double disparity = l_point.x - r_point.x;
-      camera_model.projectDisparityTo3d(l_point, disparity, world_point);
+      camera_model_.projectDisparityTo3d(l_point, disparity, world_point);
 
       if ( isfinite(world_point.x) && isfinite(world_point.y) && isfinite(world_point.z) && world_point.z > 0)
       {
         // Save
         l_kp_.push_back(l_kp[l_idx]);
         r_kp_.push_back(r_kp[r_idx]);
-        l_desc_.push_back(l_desc.row(l_idx));
-        r_desc_.push_back(r_desc.row(r_idx));
+        l_valid.push_back(l_idx);
+        r_valid.push_back(r_idx);
         camera_points_.push_back(world_point);
       }
     }
+    l_desc_ = Tools::selectRows(l_desc, l_valid.data(), l_valid.size());
+    r_desc_ = Tools::selectRows(r_desc, r_valid.data(), r_valid.size());
   }
 
-  cv::Mat Frame::computeSift()
+  bool Frame::decodeImages()
   {
-    cv::Mat sift;
-    if (l_img_.cols == 0)
-      return sift;
+    if (!l_img_gray_.empty() && !r_img_gray_.empty()) return true;
 
-    cv::Ptr<cv::Feature2D> cv_extractor;
-    cv_extractor = cv::xfeatures2d::SIFT::create();
-    cv_extractor->compute(l_img_, l_kp_, sift);
+    // Grayscale images, without copies when the messages are mono8
+    return Tools::imgMsgToMat(l_img_msg_, enc::MONO8, l_img_gray_) &&
+           Tools::imgMsgToMat(r_img_msg_, enc::MONO8, r_img_gray_);
+  }
+
+  cv::Mat Frame::getLeftImg() const
+  {
+    cv::Mat img;
+    Tools::imgMsgToMat(l_img_msg_, enc::BGR8, img);
+    return img;
+  }
 
-    return sift;
+  cv::Mat Frame::getRightImg() const
+  {
+    cv::Mat img;
+    Tools::imgMsgToMat(r_img_msg_, enc::BGR8, img);
+    return img;
   }
 
   // FROM: http://codereview.stackexchange.com/questions/23966/density-based-clustering-of-image-keypoints
   void Frame::regionClustering()
   {
     clusters_.clear();
+    cluster_centroids_.clear();
     vector< vector<int> > clusters;
     const float eps = 50.0;
     const int min_pts = 20;
@@ -121,13 +125,15 @@ namespace slam
 
     uint no_keys = l_kp_.size();
 
+    // Spatial index of the keypoints, with cells of the size of the search radius
+    KeypointGrid grid(l_kp_, eps);
+
     //init clustered and visited
     for(uint k=0; k<no_keys; k++)
     {
       clustered.push_back(false);
       visited.push_back(false);
     }
-    clusters_ = clusters;
 
     c = -1;
 
@@ -138,7 +144,7 @@ namespace slam
       {
         // Mark P as visited
         visited[i] = true;
-        neighbor_pts = regionQuery(&l_kp_, &l_kp_.at(i), eps);
+        regionQuery(grid, i, eps, neighbor_pts);
         if(neighbor_pts.size() < min_pts)
         {
           // Mark P as Noise
@@ -163,7 +169,7 @@ namespace slam
             {
               // Mark P' as visited
               visited[neighbor_pts[j]] = true;
-              neighbor_pts_ = regionQuery(&l_kp_, &l_kp_.at(neighbor_pts[j]), eps);
+              regionQuery(grid, neighbor_pts[j], eps, neighbor_pts_);
               if(neighbor_pts_.size() >= min_pts)
               {
                 neighbor_pts.insert(neighbor_pts.end(), neighbor_pts_.begin(), neighbor_pts_.end());
@@ -181,11 +187,17 @@ namespace slam
       }
     }
 
-    // Discard small clusters
+    // Discard small clusters. The cluster label of every keypoint is -1 when it does not belong to any cluster.
+    vector<int> labels(no_keys, -1);
+    int num_clusters = 0;
     for (uint i=0; i<clusters.size(); i++)
     {
       if (clusters[i].size() >= min_pts)
-        clusters_.push_back(clusters[i]);
+      {
+        for (uint j=0; j<clusters[i].size(); j++)
+          labels[clusters[i][j]] = num_clusters;
+        num_clusters++;
+      }
       else
       {
         for (uint j=0; j<clusters[i].size(); j++)
@@ -193,7 +205,8 @@ namespace slam
       }
     }
 
-    // Refine points treated as noise
+    // Refine points treated as noise: every noise point is added to the
+    // first cluster that has some keypoint into its region
     bool iterate = true;
     while (iterate && noise.size() > 0)
     {
@@ -202,27 +215,16 @@ namespace slam
       for (uint n=0; n<noise.size(); n++)
       {
         int idx = -1;
-        bool found = false;
-        cv::KeyPoint p_n = l_kp_.at(noise[n]);
-        for (uint i=0; i<clusters_.size(); i++)
+        regionQuery(grid, noise[n], eps, neighbor_pts);
+        for (uint j=0; j<neighbor_pts.size(); j++)
         {
-          for (uint j=0; j<clusters_[i].size(); j++)
-          {
-            cv::KeyPoint p_c = l_kp_.at(clusters_[i][j]);
-            float dist = sqrt(pow((p_c.pt.x - p_n.pt.x),2)+pow((p_c.pt.y - p_n.pt.y),2));
-            if(dist <= eps && dist != 0.0)
-            {
-              idx = i;
-              found = true;
-              break;
-            }
-          }
-          if (found)
-            break;
+          int label = labels[neighbor_pts[j]];
+          if (label >= 0 && (idx < 0 || label < idx))
+            idx = label;
         }
 
-        if (found && idx >= 0)
-          clusters_[idx].push_back(noise[n]);
+        if (idx >= 0)
+          labels[noise[n]] = idx;
         else
           noise_tmp.push_back(noise[n]);
       }
@@ -234,46 +236,44 @@ namespace slam
     }
 
     // If 1 cluster, add all keypoints
-    if (clusters_.size() <= 1)
+    if (num_clusters <= 1)
     {
-      vector<int> cluster_tmp;
-      for (uint i=0; i<l_kp_.size(); i++)
-        cluster_tmp.push_back(int(i));
-      clusters_.clear();
-      clusters_.push_back(cluster_tmp);
+      labels.assign(no_keys, 0);
+      num_clusters = 1;
     }
+    clusters_.build(labels, num_clusters);
 
     // Compute the clusters centroids
-    for (uint i=0; i<clusters_.size(); i++)
+    cluster_centroids_.reserve(clusters_.size());
+    for (int i=0; i<clusters_.size(); i++)
     {
-      PointCloudXYZ::Ptr cluster_points(new PointCloudXYZ);
-      for (uint j=0; j<clusters_[i].size(); j++)
+      double x = 0.0, y = 0.0, z = 0.0;
+      for (const int* it=clusters_.begin(i); it!=clusters_.end(i); ++it)
       {
-        int idx = clusters_[i][j];
-        cv::Point3f p_cv = camera_points_[idx];
-        PointXYZ p(p_cv.x, p_cv.y, p_cv.z);
-        cluster_points->push_back(p);
+        const cv::Point3f& p = camera_points_[*it];
+        x += p.x;
+        y += p.y;
+        z += p.z;
       }
-
-      Eigen::Vector4f centroid;
-      compute3DCentroid(*cluster_points, centroid);
-      cluster_centroids_.push_back(centroid);
+      const int n = max(1, clusters_.clusterSize(i));
+      cluster_centroids_.push_back(Eigen::Vector4f(x/n, y/n, z/n, 1.0));
     }
   }
 
-  vector<int> Frame::regionQuery(vector<cv::KeyPoint> *keypoints, cv::KeyPoint *keypoint, float eps)
+  void Frame::regionQuery(const KeypointGrid& grid, int idx, float eps, vector<int>& neighbors)
   {
-    float dist;
-    vector<int> ret_keys;
-    for(uint i=0; i<keypoints->size(); i++)
+    grid.radiusSearch(l_kp_[idx].pt, eps, neighbors);
+
+    // Discard the keypoints at the same position (including the query keypoint)
+    const cv::Point2f& p = l_kp_[idx].pt;
+    uint n = 0;
+    for (uint i=0; i<neighbors.size(); i++)
     {
-      dist = sqrt(pow((keypoint->pt.x - keypoints->at(i).pt.x),2)+pow((keypoint->pt.y - keypoints->at(i).pt.y),2));
-      if(dist <= eps && dist != 0.0)
-      {
-        ret_keys.push_back(i);
-      }
+      const cv::Point2f& q = l_kp_[neighbors[i]].pt;
+      if (q.x != p.x || q.y != p.y)
+        neighbors[n++] = neighbors[i];
     }
-    return ret_keys;
+    neighbors.resize(n);
   }
 
 } //namespace slam
\ No newline at end of file
@@ -1,3 +1,6 @@
+#include <cstdio>
+#include <cmath>
+
 #include "constants.h"
 #include "graph.h"
 #include "cluster.h"
@@ -8,7 +11,51 @@ using namespace tools;
 namespace slam
 {
 
-  Graph::Graph(LoopClosing* loop_closing) : frame_id_(-1), loop_closing_(loop_closing)
+  static const string VERTICES_HEADER = "% timestamp, frame id, x, y, z, qx, qy, qz, qw\n";
+  static const string EDGES_HEADER = "% frame a, frame b, inliers, ax, ay, az, aqx, aqy, aqz, aqw, bx, by, bz, bqx, bqy, bqz, bqw\n";
+
+  // Append a value with 6 decimals (snprintf is much cheaper than the iostream formatting)
+  static inline void appendValue(string& out, double value)
+  {
+    char buf[32];
+    int n = snprintf(buf, sizeof(buf), "%.6f", value);
+    out.append(buf, n);
+  }
+
+  static inline void appendValue(string& out, int value)
+  {
+    char buf[16];
+    int n = snprintf(buf, sizeof(buf), "%d", value);
+    out.append(buf, n);
+  }
+
+  static inline void appendPose(string& out, const tf::Transform& pose)
+  {
+    const tf::Vector3& t = pose.getOrigin();
+    const tf::Quaternion q = pose.getRotation();
+    appendValue(out, (double)t.x()); out += ',';
+    appendValue(out, (double)t.y()); out += ',';
+    appendValue(out, (double)t.z()); out += ',';
+    appendValue(out, (double)q.x()); out += ',';
+    appendValue(out, (double)q.y()); out += ',';
+    appendValue(out, (double)q.z()); out += ',';
+    appendValue(out, (double)q.w());
+  }
+
+  // Append a loop closing edge line
+  static inline void appendEdge(string& out, int vertex_a, int vertex_b, int inliers,
+                                const tf::Transform& pose_a, const tf::Transform& pose_b)
+  {
+    appendValue(out, vertex_a); out += ',';
+    appendValue(out, vertex_b); out += ',';
+    appendValue(out, inliers); out += ',';
+    appendPose(out, pose_a); out += ',';
+    appendPose(out, pose_b);
+    out += '\n';
+  }
+
+  Graph::Graph(LoopClosing* loop_closing) : optimizer_stop_flag_(false), frame_queue_(GRAPH_QUEUE_SIZE), frame_id_(-1), loop_closing_(loop_closing), delta_version_(0),
+    max_trans_information_(0.0), max_rot_information_(0.0)
   {
     init();
   }
@@ -23,104 +70,134 @@ namespace slam
       new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
     graph_optimizer_.setAlgorithm(solver);
 
-    // Remove locking file if exists
-    string lock_file = WORKING_DIRECTORY + ".graph.lock";
-    if (fs::exists(lock_file))
-      remove(lock_file.c_str());
+    // Stop the optimization when the chi2 gain is small
+    g2o::SparseOptimizerTerminateAction* terminate_action = new g2o::SparseOptimizerTerminateAction();
+    terminate_action->setGainThreshold(GRAPH_GAIN_THRESH);
+    graph_optimizer_.addPostIterationAction(terminate_action);
+    graph_optimizer_.setForceStopFlag(&optimizer_stop_flag_);
+
+    // Start the graph files (only the headers)
+    vertices_file_ = WORKING_DIRECTORY + "graph_vertices.txt";
+    edges_file_ = WORKING_DIRECTORY + "graph_edges.txt";
+    saved_frames_ = 0;
+    writeFile(vertices_file_, VERTICES_HEADER, false);
+    writeFile(edges_file_, EDGES_HEADER, false);
 
     // Advertise topics
     ros::NodeHandle nhp("~");
     pose_pub_ = nhp.advertise<nav_msgs::Odometry>("graph_camera_odometry", 1);
     graph_pub_ = nhp.advertise<stereo_slam::GraphPoses>("graph_poses", 2);
+    queue_pub_ = nhp.advertise<std_msgs::Int32>("graph_queue", 2, true);
+    queue_age_pub_ = nhp.advertise<std_msgs::Float32>("graph_queue_age", 2, true);
+    graph_delta_pub_ = nhp.advertise<stereo_slam::GraphPosesDelta>("graph_poses_delta", 100);
+    snapshot_srv_ = nhp.advertiseService("publish_graph_snapshot", &Graph::publishSnapshot, this);
   }
 
   void Graph::run()
   {
-    ros::Rate r(50);
-    while(ros::ok())
+    mutex::scoped_lock run_lock(mutex_run_);
+
+    // Wait for new frames and insert all the queued ones
+    vector<QueuedFrame> frames;
+    double oldest_age;
+    while(ros::ok() && frame_queue_.popAll(frames, oldest_age))
     {
-      if(checkNewFrameInQueue())
-      {
-        processNewFrame();
-      }
-      r.sleep();
+      publishQueueState(frames.size(), oldest_age);
+      for (uint i=0; i<frames.size() && ros::ok(); i++)
+        processNewFrame(frames[i]);
+
+      // Drop the image messages of the processed frames
+      frames.clear();
     }
   }
 
-  void Graph::addFrameToQueue(Frame frame)
+  void Graph::finalize()
   {
-    mutex::scoped_lock lock(mutex_frame_queue_);
-    frame_queue_.push_back(frame);
+    frame_queue_.close();
+
+    // Wait for the graph thread and write the final graph. The loop closing edges added later are journaled.
+    mutex::scoped_lock run_lock(mutex_run_);
+    saveGraphSnapshot(true);
   }
 
-  bool Graph::checkNewFrameInQueue()
+  void Graph::addFrameToQueue(const KeyFramePtr& frame, const sensor_msgs::ImageConstPtr& l_img_msg,
+                              const sensor_msgs::ImageConstPtr& r_img_msg)
   {
-    mutex::scoped_lock lock(mutex_frame_queue_);
-    return(!frame_queue_.empty());
+    QueuedFrame queued_frame;
+    queued_frame.keyframe = frame;
+    queued_frame.l_img_msg = l_img_msg;
+    queued_frame.r_img_msg = r_img_msg;
+    frame_queue_.push(queued_frame);
   }
 
-  void Graph::processNewFrame()
+  void Graph::publishQueueState(int depth, double age)
   {
-    // Get the frame
-    Frame frame;
+    if (queue_pub_.getNumSubscribers() > 0)
+    {
+      std_msgs::Int32 msg;
+      msg.data = depth;
+      queue_pub_.publish(msg);
+    }
+    if (queue_age_pub_.getNumSubscribers() > 0)
     {
-      mutex::scoped_lock lock(mutex_frame_queue_);
-      frame = frame_queue_.front();
-      frame_queue_.pop_front();
+      std_msgs::Float32 msg;
+      msg.data = age;
+      queue_age_pub_.publish(msg);
     }
+  }
+
+  void Graph::processNewFrame(const QueuedFrame& queued_frame)
+  {
+    const KeyFramePtr& frame = queued_frame.keyframe;
 
     // The clusters of this frame
-    vector< vector<int> > clusters = frame.getClusters();
+    const ClusterSet& clusters = frame->getClusters();
 
     // Frame id
-    frame_id_ = frame.getId();
+    frame_id_ = frame->getId();
 
-    // Save the frame
-    saveFrame(frame);
+    // Save the frame images (they are not needed anymore)
+    saveFrame(queued_frame);
 
     // Save the frame timestamp
-    frame_stamps_.push_back(frame.getTimestamp());
-
-    // Extract sift
-    cv::Mat sift_desc = frame.computeSift();
+    {
+      mutex::scoped_lock lock(mutex_graph_);
+      frame_stamps_.push_back(frame->getTimestamp());
+    }
 
     // Loop of frame clusters
     vector<int> vertex_ids;
-    vector<Cluster> clusters_to_close_loop;
-    vector<Eigen::Vector4f> cluster_centroids = frame.getClusterCentroids();
-    vector<cv::Point3f> points = frame.getCameraPoints();
-    vector<cv::KeyPoint> kp_l = frame.getLeftKp();
-    vector<cv::KeyPoint> kp_r = frame.getRightKp();
-    tf::Transform camera_pose = frame.getCameraPose();
-    cv::Mat orb_desc = frame.getLeftDesc();
-    for (uint i=0; i<clusters.size(); i++)
+    vector<ClusterPtr> clusters_to_close_loop;
+    const vector<Eigen::Vector4f>& cluster_centroids = frame->getClusterCentroids();
+    const vector<cv::Point3f>& points = frame->getCameraPoints();
+    const vector<cv::KeyPoint>& kp_l = frame->getLeftKp();
+    const vector<cv::KeyPoint>& kp_r = frame->getRightKp();
+    tf::Transform camera_pose = frame->getCameraPose();
+    const cv::Mat& desc = frame->getLeftDesc();
+    for (int i=0; i<clusters.size(); i++)
     {
       // Correct cluster pose with the last graph update
       tf::Transform cluster_pose = Tools::transformVector4f(cluster_centroids[i], camera_pose);
-      initial_cluster_pose_history_.push_back(cluster_pose);
 
       // Add cluster to the graph
-      int id = addVertex(cluster_pose);
-
-      // Store information
-      cluster_frame_relation_.push_back( make_pair(id, frame_id_) );
-      local_cluster_poses_.push_back( Tools::vector4fToTransform(cluster_centroids[i]) );
+      int id = addVertex(cluster_pose, frame_id_, Tools::vector4fToTransform(cluster_centroids[i]));
       vertex_ids.push_back(id);
 
       // Build cluster
-      cv::Mat c_desc_orb, c_desc_sift;
+      const int c_size = clusters.clusterSize(i);
       vector<cv::KeyPoint> c_kp_l, c_kp_r;
       vector<cv::Point3f> c_points;
-      for (uint j=0; j<clusters[i].size(); j++)
+      c_kp_l.reserve(c_size);
+      c_kp_r.reserve(c_size);
+      c_points.reserve(c_size);
+      for (const int* it=clusters.begin(i); it!=clusters.end(i); ++it)
       {
-        int idx = clusters[i][j];
-        c_kp_l.push_back(kp_l[idx]);
-        c_kp_r.push_back(kp_r[idx]);
-        c_points.push_back(points[idx]);
-        c_desc_orb.push_back(orb_desc.row(idx));
-        c_desc_sift.push_back(sift_desc.row(idx));
+        c_kp_l.push_back(kp_l[*it]);
+        c_kp_r.push_back(kp_r[*it]);
+        c_points.push_back(points[*it]);
       }
-      Cluster cluster(id, frame_id_, camera_pose, c_kp_l, c_kp_r, c_desc_orb, c_desc_sift, c_points);
+      cv::Mat c_desc = Tools::selectRows(desc, clusters.begin(i), c_size);
+      ClusterPtr cluster(new Cluster(id, frame_id_, camera_pose, std::move(c_kp_l), std::move(c_kp_r), c_desc, std::move(c_points)));
       clusters_to_close_loop.push_back(cluster);
     }
 
@@ -142,9 +219,9 @@ namespace slam
         tf::Transform pose_a = getVertexPose(id_a);
         tf::Transform pose_b = getVertexPose(id_b);
 
+        // The clusters of a frame are rigidly attached
         tf::Transform edge = pose_a.inverse() * pose_b;
-        cv::Mat eye = cv::Mat::eye(6, 6, CV_64F);
-        addEdge(id_a, id_b, edge, eye, 0);
+        addRigidEdge(id_a, id_b, edge);
       }
     }
 
@@ -184,14 +261,13 @@ namespace slam
 
       if (closest_vertices.size() > 0)
       {
-        cv::Mat eye = cv::Mat::eye(6, 6, CV_64F);
         tf::Transform edge = closest_poses[0].inverse() * closest_poses[1];
-        addEdge(closest_vertices[0], closest_vertices[1], edge, frame.getSigmaWithPreviousFrame(), frame.getInliersNumWithPreviousFrame());
 
-        int frame_i = Graph::getVertexFrameId(closest_vertices[0]);
-        int frame_j = Graph::getVertexFrameId(closest_vertices[1]);
-        Edge ee(frame_i, frame_j, frame.getInliersNumWithPreviousFrame());
-        edges_information_.push_back(ee);
+        // The refined motion information is moved from the camera to the current cluster frame
+        cv::Mat information = frame->getInformationWithPreviousFrame();
+        if (frame->getInliersNumWithPreviousFrame() > 0)
+          information = Tools::transformInformation(information, getVertexPoseRelativeToCamera(closest_vertices[0]) * edge);
+        addEdge(closest_vertices[0], closest_vertices[1], edge, information, frame->getInliersNumWithPreviousFrame());
       }
       else
         ROS_ERROR("[Localization:] Impossible to connect current and previous frame. Graph will have non-connected parts!");
@@ -202,12 +278,13 @@ namespace slam
 
     // Publish the graph
     publishGraph();
+    publishGraphDelta(true);
 
     // Publish camera pose
     int last_idx = -1;
     {
       mutex::scoped_lock lock(mutex_graph_);
-      last_idx = graph_optimizer_.vertices().size() - 1;
+      last_idx = vertices_.size() - 1;
     }
     tf::Transform updated_camera_pose = getVertexCameraPose(last_idx, true);
     publishCameraPose(updated_camera_pose);
@@ -217,15 +294,17 @@ namespace slam
   {
     // Get last
     int last_idx = -1;
+    tf::Transform last_graph_initial;
     {
       mutex::scoped_lock lock(mutex_graph_);
-      last_idx = graph_optimizer_.vertices().size() - 1;
+      last_idx = vertices_.size() - 1;
+      if (last_idx >= 0)
+        last_graph_initial = vertices_[last_idx].initial_pose;
     }
 
-    if (initial_cluster_pose_history_.size() > 0 && last_idx >= 0)
+    if (last_idx >= 0)
     {
       tf::Transform last_graph_pose = getVertexPose(last_idx);
-      tf::Transform last_graph_initial = initial_cluster_pose_history_.at(last_idx);
       tf::Transform diff = last_graph_initial.inverse() * initial_pose;
 
       // Compute the corrected pose
@@ -254,7 +333,7 @@ namespace slam
     return combinations;
   }
 
-  int Graph::addVertex(tf::Transform pose)
+  int Graph::addVertex(const tf::Transform& pose, int frame_id, const tf::Transform& local_pose)
   {
     mutex::scoped_lock lock(mutex_graph_);
 
@@ -262,7 +341,7 @@ namespace slam
     Eigen::Isometry3d vertex_pose = Tools::tfToIsometry(pose);
 
     // Set node id equal to graph size
-    int id = graph_optimizer_.vertices().size();
+    int id = vertices_.size();
 
     // Build the vertex
     g2o::VertexSE3* cur_vertex = new g2o::VertexSE3();
@@ -274,76 +353,93 @@ namespace slam
       cur_vertex->setFixed(true);
     }
     graph_optimizer_.addVertex(cur_vertex);
+
+    // Store the vertex information and index it by frame (the vertices of a frame are consecutive)
+    vertices_.push_back(VertexRecord(frame_id, local_pose, pose, cur_vertex));
+    if (frame_id >= (int)frame_vertices_.size())
+      frame_vertices_.resize(frame_id + 1, make_pair(id, 0));
+    if (frame_vertices_[frame_id].second == 0)
+      frame_vertices_[frame_id].first = id;
+    frame_vertices_[frame_id].second++;
     return id;
   }
 
-  void Graph::addEdge(int i, int j, tf::Transform edge, cv::Mat sigma, int inliers)
+  void Graph::addEdge(int i, int j, tf::Transform edge, const cv::Mat& information, int inliers)
   {
-    mutex::scoped_lock lock(mutex_graph_);
-
-    // Store edge information
-    int frame_i = Graph::getVertexFrameId(i);
-    int frame_j = Graph::getVertexFrameId(j);
-    bool lc_found = false;
-    for (uint i=0; i<edges_information_.size(); i++)
+    // The files are locked before the graph (as in saveGraphSnapshot), so a loop closing edge is either in
+    // the snapshot or appended after it
+    mutex::scoped_lock files_lock(mutex_files_);
+    string edge_line;
     {
-      Edge ee = edges_information_[i];
-      if ( (ee.vertice_a == frame_i && ee.vertice_b == frame_j) ||
-           (ee.vertice_a == frame_j && ee.vertice_b == frame_i) )
+      mutex::scoped_lock lock(mutex_graph_);
+
+      // Accumulate the inliers between the two frames
+      const int frame_a = vertices_[i].frame_id;
+      const int frame_b = vertices_[j].frame_id;
+      frame_edges_.add(frame_a, frame_b, inliers);
+
+      // The information is given for a (translation, rotation vector) error, while g2o uses the imaginary part
+      // of the quaternion, which is half the rotation vector
+      Eigen::Matrix<double, 6, 6> edge_information;
+      for (int r=0; r<6; r++)
       {
-        lc_found = true;
-        edges_information_[i].inliers = ee.inliers + inliers;
-        break;
+        for (int c=0; c<6; c++)
+        {
+          double scale = (r < 3 ? 1.0 : 2.0) * (c < 3 ? 1.0 : 2.0);
+          edge_information(r, c) = 0.5 * scale * (information.at<double>(r, c) + information.at<double>(c, r));
+        }
+      }
+
+      // The rigid edges must dominate the strongest edge of the graph
+      for (int k=0; k<3; k++)
+      {
+        max_trans_information_ = max(max_trans_information_, edge_information(k, k));
+        max_rot_information_ = max(max_rot_information_, edge_information(k+3, k+3));
+      }
+
+      insertEdge(i, j, edge, edge_information);
+
+      // Journal line of the loop closing edges
+      if (abs(frame_a - frame_b) > 1)
+      {
+        appendEdge(edge_line, i, j, frame_edges_.get(frame_a, frame_b),
+                   getVertexCameraPose(i, false)*camera2odom_, getVertexCameraPose(j, false)*camera2odom_);
       }
     }
 
-    if (!lc_found)
+    // Append it to the edges file
+    if (!edge_line.empty())
+      writeFile(edges_file_, edge_line, true);
+  }
+
+  void Graph::addRigidEdge(int i, int j, tf::Transform edge)
+  {
+    mutex::scoped_lock lock(mutex_graph_);
+    frame_edges_.add(vertices_[i].frame_id, vertices_[j].frame_id, 0);
+    rigid_edges_.push_back(insertEdge(i, j, edge, rigidInformation()));
+  }
+
+  Eigen::Matrix<double, 6, 6> Graph::rigidInformation() const
+  {
+    // The PnP information assumes 1 pixel reprojection noise, so it has no fixed scale: the clusters of a
+    // frame share the frame camera pose exactly, which is modeled as GRAPH_RIGID_GAIN times the strongest
+    // edge information of every block (finite, to keep the system well conditioned)
+    Eigen::Matrix<double, 6, 6> information = Eigen::Matrix<double, 6, 6>::Zero();
+    const double trans = max(GRAPH_RIGID_INFORMATION, GRAPH_RIGID_GAIN * max_trans_information_);
+    const double rot = max(GRAPH_RIGID_INFORMATION, GRAPH_RIGID_GAIN * max_rot_information_);
+    for (int k=0; k<3; k++)
     {
-      Edge e_info(frame_i, frame_j, inliers);
-      edges_information_.push_back(e_info);
+      information(k, k) = trans;
+      information(k+3, k+3) = rot;
     }
+    return information;
+  }
 
-    // Eigen::Matrix<double, 6, 6> information;
-    // information(0,0) = sigma.at<double>(0,0);
-    // information(0,1) = sigma.at<double>(0,1);
-    // information(0,2) = sigma.at<double>(0,2);
-    // information(0,3) = sigma.at<double>(0,3);
-    // information(0,4) = sigma.at<double>(0,4);
-    // information(0,5) = sigma.at<double>(0,5);
-    // information(1,0) = sigma.at<double>(1,0);
-    // information(1,1) = sigma.at<double>(1,1);
-    // information(1,2) = sigma.at<double>(1,2);
-    // information(1,3) = sigma.at<double>(1,3);
-    // information(1,4) = sigma.at<double>(1,4);
-    // information(1,5) = sigma.at<double>(1,5);
-    // information(2,0) = sigma.at<double>(2,0);
-    // information(2,1) = sigma.at<double>(2,1);
-    // information(2,2) = sigma.at<double>(2,2);
-    // information(2,3) = sigma.at<double>(2,3);
-    // information(2,4) = sigma.at<double>(2,4);
-    // information(2,5) = sigma.at<double>(2,5);
-    // information(3,0) = sigma.at<double>(3,0);
-    // information(3,1) = sigma.at<double>(3,1);
-    // information(3,2) = sigma.at<double>(3,2);
-    // information(3,3) = sigma.at<double>(3,3);
-    // information(3,4) = sigma.at<double>(3,4);
-    // information(3,5) = sigma.at<double>(3,5);
-    // information(4,0) = sigma.at<double>(4,0);
-    // information(4,1) = sigma.at<double>(4,1);
-    // information(4,2) = sigma.at<double>(4,2);
-    // information(4,3) = sigma.at<double>(4,3);
-    // information(4,4) = sigma.at<double>(4,4);
-    // information(4,5) = sigma.at<double>(4,5);
-    // information(5,0) = sigma.at<double>(5,0);
-    // information(5,1) = sigma.at<double>(5,1);
-    // information(5,2) = sigma.at<double>(5,2);
-    // information(5,3) = sigma.at<double>(5,3);
-    // information(5,4) = sigma.at<double>(5,4);
-    // information(5,5) = sigma.at<double>(5,5);
-
+  g2o::EdgeSE3* Graph::insertEdge(int i, int j, const tf::Transform& edge, const Eigen::Matrix<double, 6, 6>& information)
+  {
     // Get the vertices
-    g2o::VertexSE3* v_i = dynamic_cast<g2o::VertexSE3*>(graph_optimizer_.vertices()[i]);
-    g2o::VertexSE3* v_j = dynamic_cast<g2o::VertexSE3*>(graph_optimizer_.vertices()[j]);
+    g2o::VertexSE3* v_i = vertices_[i].vertex;
+    g2o::VertexSE3* v_j = vertices_[j].vertex;
 
     // Add the new edge to graph
     g2o::EdgeSE3* e = new g2o::EdgeSE3();
@@ -351,39 +447,59 @@ namespace slam
     e->setVertex(0, v_i);
     e->setVertex(1, v_j);
     e->setMeasurement(t);
-    // e->setInformation(information);
+    e->setInformation(information);
 
     graph_optimizer_.addEdge(e);
+    return e;
   }
 
   void Graph::update()
   {
-    mutex::scoped_lock lock(mutex_graph_);
+    int iterations = 0;
+    {
+      mutex::scoped_lock lock(mutex_graph_);
 
-    // Optimize!
-    graph_optimizer_.initializeOptimization();
-    graph_optimizer_.optimize(20);
+      // The strongest edge may have changed since the rigid edges were added
+      Eigen::Matrix<double, 6, 6> rigid = rigidInformation();
+      for (uint i=0; i<rigid_edges_.size(); i++)
+        rigid_edges_[i]->setInformation(rigid);
+
+      // Optimize!
+      optimizer_stop_flag_ = false;
+      graph_optimizer_.initializeOptimization();
+      iterations = graph_optimizer_.optimize(20);
+
+      ROS_INFO_STREAM("[Localization:] Optimization done in graph with " << graph_optimizer_.vertices().size() << " vertices (" << iterations << " iterations).");
+    }
 
-    ROS_INFO_STREAM("[Localization:] Optimization done in graph with " << graph_optimizer_.vertices().size() << " vertices.");
+    // Publish the moved poses and compact the graph files when the written poses are outdated
+    if (iterations > 0)
+    {
+      publishGraphDelta(false);
+      saveGraphSnapshot();
+    }
   }
 
   void Graph::findClosestVertices(int vertex_id, int window_center, int window, int best_n, vector<int> &neighbors)
   {
     // Init
     neighbors.clear();
-    tf::Transform vertex_pose = getVertexPose(vertex_id);
 
     // Loop thought all the other nodes
     vector< pair< int,double > > neighbor_distances;
-    for (uint i=0; i<graph_optimizer_.vertices().size(); i++)
     {
-      if ( (int)i == vertex_id ) continue;
-      if ((int)i > window_center-window && (int)i < window_center+window) continue;
+      mutex::scoped_lock lock(mutex_graph_);
+      tf::Transform vertex_pose = getVertexPose(vertex_id, false);
+      for (uint i=0; i<vertices_.size(); i++)
+      {
+        if ( (int)i == vertex_id ) continue;
+        if ((int)i > window_center-window && (int)i < window_center+window) continue;
 
-      // Get the node pose
-      tf::Transform cur_pose = getVertexPose(i);
-      double dist = Tools::poseDiff2D(cur_pose, vertex_pose);
-      neighbor_distances.push_back(make_pair(i, dist));
+        // Get the node pose
+        tf::Transform cur_pose = getVertexPose(i, false);
+        double dist = Tools::poseDiff2D(cur_pose, vertex_pose);
+        neighbor_distances.push_back(make_pair(i, dist));
+      }
     }
 
     // Exit if no neighbors
@@ -403,112 +519,80 @@ namespace slam
   void Graph::getFrameVertices(int frame_id, vector<int> &vertices)
   {
     vertices.clear();
-    for (uint i=0; i<cluster_frame_relation_.size(); i++)
-    {
-      if (cluster_frame_relation_[i].second == frame_id)
-        vertices.push_back(cluster_frame_relation_[i].first);
-    }
+    mutex::scoped_lock lock(mutex_graph_);
+    if (frame_id < 0 || frame_id >= (int)frame_vertices_.size()) return;
+    const pair<int, int>& range = frame_vertices_[frame_id];
+    for (int i=0; i<range.second; i++)
+      vertices.push_back(range.first + i);
   }
 
   int Graph::getVertexFrameId(int id)
   {
-    int frame_id = -1;
-    for (uint i=0; i<cluster_frame_relation_.size(); i++)
-    {
-      if (cluster_frame_relation_[i].first == id)
-      {
-        frame_id = cluster_frame_relation_[i].second;
-        break;
-      }
-    }
-    return frame_id;
+    mutex::scoped_lock lock(mutex_graph_);
+    if (id < 0 || id >= (int)vertices_.size()) return -1;
+    return vertices_[id].frame_id;
   }
 
   int Graph::getLastVertexFrameId()
   {
-    // Get last
-    int last_idx = -1;
-    {
-      mutex::scoped_lock lock(mutex_graph_);
-      last_idx = graph_optimizer_.vertices().size() - 1;
-    }
-
-    return getVertexFrameId(last_idx);
+    mutex::scoped_lock lock(mutex_graph_);
+    if (vertices_.empty()) return -1;
+    return vertices_.back().frame_id;
   }
 
-
   tf::Transform Graph::getVertexPose(int id, bool lock)
   {
+    mutex::scoped_lock graph_lock(mutex_graph_, boost::defer_lock);
     if (lock)
-    {
-      mutex::scoped_lock lock(mutex_graph_);
+      graph_lock.lock();
 
-      if( id >= 0)
-      {
-        g2o::VertexSE3* vertex =  dynamic_cast<g2o::VertexSE3*>(graph_optimizer_.vertices()[id]);
-        return Tools::getVertexPose(vertex);
-      }
-      else
-      {
-        tf::Transform tmp;
-        tmp.setIdentity();
-        return tmp;
-      }
-    }
-    else
+    if (id < 0)
     {
-      if( id >= 0)
-      {
-        g2o::VertexSE3* vertex =  dynamic_cast<g2o::VertexSE3*>(graph_optimizer_.vertices()[id]);
-        return Tools::getVertexPose(vertex);
-      }
-      else
-      {
-        tf::Transform tmp;
-        tmp.setIdentity();
-        return tmp;
-      }
+      tf::Transform tmp;
+      tmp.setIdentity();
+      return tmp;
     }
+    return Tools::getVertexPose(vertices_[id].vertex);
   }
 
   bool Graph::getFramePose(int frame_id, tf::Transform& frame_pose)
   {
     frame_pose.setIdentity();
-    vector<int> frame_vertices;
-    getFrameVertices(frame_id, frame_vertices);
-
-    if (frame_vertices.size() == 0)
-    {
+    mutex::scoped_lock lock(mutex_graph_);
+    if (frame_id < 0 || frame_id >= (int)frame_vertices_.size() || frame_vertices_[frame_id].second == 0)
       return false;
-    }
-    else
-    {
-      frame_pose = getVertexCameraPose(frame_vertices[0]);
-      return true;
-    }
+
+    frame_pose = getVertexCameraPose(frame_vertices_[frame_id].first, false);
+    return true;
   }
 
   tf::Transform Graph::getVertexPoseRelativeToCamera(int id)
   {
-    return local_cluster_poses_[id];
+    mutex::scoped_lock lock(mutex_graph_);
+    return vertices_[id].local_pose;
   }
 
   tf::Transform Graph::getVertexCameraPose(int id, bool lock)
   {
-    tf::Transform vertex_pose = getVertexPose(id, lock);
-    return vertex_pose * local_cluster_poses_[id].inverse();
+    mutex::scoped_lock graph_lock(mutex_graph_, boost::defer_lock);
+    if (lock)
+      graph_lock.lock();
+
+    tf::Transform vertex_pose = getVertexPose(id, false);
+    return vertex_pose * vertices_[id].local_pose.inverse();
   }
 
-  void Graph::saveFrame(Frame frame)
+  void Graph::saveFrame(const QueuedFrame& queued_frame)
   {
-    cv::Mat l_img, r_img, c_img;
-    frame.getLeftImg().copyTo(l_img);
-    frame.getRightImg().copyTo(r_img);
-    frame.getLeftImg().copyTo(c_img);
-    if (l_img.cols == 0 || r_img.cols == 0)
+    cv::Mat l_img, r_img;
+    if (!Tools::imgMsgToMat(queued_frame.l_img_msg, enc::BGR8, l_img) ||
+        !Tools::imgMsgToMat(queued_frame.r_img_msg, enc::BGR8, r_img) ||
+        l_img.cols == 0 || r_img.cols == 0)
       return;
+    const KeyFramePtr& frame = queued_frame.keyframe;
+    cv::Mat c_img = l_img.clone();
 
-    string frame_id_str = Tools::convertTo5digits(frame.getId());
+    string frame_id_str = Tools::convertTo5digits(frame->getId());
 
     // Save keyframe
     string l_kf = WORKING_DIRECTORY + "keyframes/" + frame_id_str + "_left.jpg";
@@ -517,138 +601,159 @@ namespace slam
     cv::imwrite(r_kf, r_img);
 
     // Save keyframe with clusters
-    vector< vector<int> > clusters = frame.getClusters();
-    vector<cv::KeyPoint> kp = frame.getLeftKp();
+    const ClusterSet& clusters = frame->getClusters();
+    const vector<cv::KeyPoint>& kp = frame->getLeftKp();
     cv::RNG rng(12345);
-    for (uint i=0; i<clusters.size(); i++)
+    for (int i=0; i<clusters.size(); i++)
     {
       cv::Scalar color = cv::Scalar(rng.uniform(0,255), rng.uniform(0, 255), rng.uniform(0, 255));
-      for (uint j=0; j<clusters[i].size(); j++)
-        cv::circle(c_img, kp[clusters[i][j]].pt, 5, color, -1);
+      for (const int* it=clusters.begin(i); it!=clusters.end(i); ++it)
+        cv::circle(c_img, kp[*it].pt, 5, color, -1);
     }
     string clusters_file = WORKING_DIRECTORY + "clusters/" + frame_id_str + ".jpg";
     cv::imwrite(clusters_file, c_img);
   }
 
-  void Graph::saveGraph()
+  bool Graph::writeFile(const string& file, const string& data, bool append)
   {
-    string lock_file, vertices_file, edges_file;
-    vertices_file = WORKING_DIRECTORY + "graph_vertices.txt";
-    edges_file = WORKING_DIRECTORY + "graph_edges.txt";
-    lock_file = WORKING_DIRECTORY + ".graph.lock";
+    // Every write is a single call, so a reader never sees a partial append
+    string tmp_file = file + ".tmp";
+    FILE* f = fopen(append ? file.c_str() : tmp_file.c_str(), append ? "a" : "w");
+    bool ok = f != NULL;
+    if (ok)
+    {
+      ok = fwrite(data.data(), 1, data.size(), f) == data.size();
+      ok = (fclose(f) == 0) && ok;
+    }
 
-    // Wait until lock file has been released
-    while(fs::exists(lock_file));
+    // The full rewrites replace the file atomically
+    if (ok && !append)
+      ok = rename(tmp_file.c_str(), file.c_str()) == 0;
 
-    // Create a locking element
-    fstream f_lock(lock_file.c_str(), ios::out | ios::trunc);
+    if (!ok)
+      ROS_ERROR_STREAM("[Localization:] Error writing the graph file " << file);
+    return ok;
+  }
 
-    // Open to append
-    fstream f_vertices(vertices_file.c_str(), ios::out | ios::trunc);
-    fstream f_edges(edges_file.c_str(), ios::out | ios::trunc);
+  int Graph::getFramePoses(int first_frame, vector<int>& frame_ids, vector<tf::Transform>& poses,
+                           vector<double>* stamps)
+  {
+    frame_ids.clear();
+    poses.clear();
+    if (stamps) stamps->clear();
 
+    // The pose of a frame is the camera pose of its first vertex
     mutex::scoped_lock lock(mutex_graph_);
+    for (int id=max(first_frame, 0); id<(int)frame_vertices_.size(); id++)
+    {
+      if (frame_vertices_[id].second == 0) continue;
+      frame_ids.push_back(id);
+      poses.push_back(getVertexCameraPose(frame_vertices_[id].first, false));
+      if (stamps) stamps->push_back(frame_stamps_[id]);
+    }
+    return frame_vertices_.size();
+  }
+
+  void Graph::formatVertices(const vector<int>& frame_ids, const vector<double>& stamps,
+                             const vector<tf::Transform>& poses, string& out)
+  {
+    out.reserve(out.size() + frame_ids.size() * 128);
+    for (uint i=0; i<frame_ids.size(); i++)
+    {
+      appendValue(out, stamps[i]); out += ',';
+      appendValue(out, frame_ids[i]); out += ',';
+      appendPose(out, poses[i]*camera2odom_);
+      out += '\n';
+    }
+  }
 
-    // First line
-    f_vertices << "% timestamp, frame id, x, y, z, qx, qy, qz, qw" << endl;
+  void Graph::setSavedPoses(const vector<int>& frame_ids, const vector<tf::Transform>& poses)
+  {
+    for (uint i=0; i<frame_ids.size(); i++)
+    {
+      if (frame_ids[i] >= (int)saved_poses_.size())
+        saved_poses_.resize(frame_ids[i] + 1);
+      saved_poses_[frame_ids[i]] = poses[i];
+    }
+  }
 
-    vector<int> processed_frames;
+  void Graph::saveGraph()
+  {
+    mutex::scoped_lock lock(mutex_files_);
+
+    // Append the frames that are not in the file yet (the poses are collected under the graph lock)
+    vector<int> frame_ids;
+    vector<double> stamps;
+    vector<tf::Transform> poses;
+    int num_frames = getFramePoses(saved_frames_, frame_ids, poses, &stamps);
+    if (frame_ids.empty()) return;
+
+    string data;
+    formatVertices(frame_ids, stamps, poses, data);
+    if (writeFile(vertices_file_, data, true))
+    {
+      saved_frames_ = num_frames;
+      setSavedPoses(frame_ids, poses);
+    }
+  }
 
-    // Output the vertices file
-    for (uint i=0; i<graph_optimizer_.vertices().size(); i++)
+  void Graph::saveGraphSnapshot(bool force)
+  {
+    mutex::scoped_lock lock(mutex_files_);
+
+    // Collect the poses under the graph lock
+    vector<int> frame_ids;
+    vector<double> stamps;
+    vector<tf::Transform> poses;
+    int num_frames = getFramePoses(0, frame_ids, poses, &stamps);
+
+    // Compact only when the written poses are outdated. The frames that are not in the file (a failed
+    // append) are always outdated.
+    bool outdated = force;
+    for (uint i=0; i<frame_ids.size() && !outdated; i++)
     {
-      // Is this frame processed?
-      bool found = false;
-      int id = getVertexFrameId(i);
-      for (uint j=0; j<processed_frames.size(); j++)
+      if (frame_ids[i] >= (int)saved_poses_.size())
       {
-        if (processed_frames[j] == id)
-        {
-          found = true;
-          break;
-        }
+        outdated = true;
+        continue;
       }
-      if (found) continue;
-      processed_frames.push_back(id);
-
-      tf::Transform pose = getVertexCameraPose(i, false)*camera2odom_;
-      f_vertices << fixed <<
-        setprecision(6) <<
-        frame_stamps_[id] << "," <<
-        id << "," <<
-        pose.getOrigin().x() << "," <<
-        pose.getOrigin().y() << "," <<
-        pose.getOrigin().z() << "," <<
-        pose.getRotation().x() << "," <<
-        pose.getRotation().y() << "," <<
-        pose.getRotation().z() << "," <<
-        pose.getRotation().w() <<  endl;
+      const tf::Transform& saved = saved_poses_[frame_ids[i]];
+      outdated = Tools::poseDiff3D(saved, poses[i]) > GRAPH_SNAPSHOT_TRANS_TOL ||
+                 fabs(saved.getRotation().angleShortestPath(poses[i].getRotation())) > GRAPH_SNAPSHOT_ROT_TOL;
     }
-    f_vertices.close();
-
-    // First line
-    f_edges << "% frame a, frame b, inliers, ax, ay, az, aqx, aqy, aqz, aqw, bx, by, bz, bqx, bqy, bqz, bqw" << endl;
+    if (!outdated) return;
 
-    // Output the edges file
-    for ( g2o::OptimizableGraph::EdgeSet::iterator it=graph_optimizer_.edges().begin();
-        it!=graph_optimizer_.edges().end(); it++)
+    // Collect the loop closing edges under the graph lock
+    string edges_data = EDGES_HEADER;
     {
-      g2o::EdgeSE3* e = dynamic_cast<g2o::EdgeSE3*> (*it);
-      if (e)
+      mutex::scoped_lock graph_lock(mutex_graph_);
+      for ( g2o::OptimizableGraph::EdgeSet::iterator it=graph_optimizer_.edges().begin();
+          it!=graph_optimizer_.edges().end(); it++)
       {
-        // Get the frames corresponding to these edges
-        int frame_a = Graph::getVertexFrameId(e->vertices()[0]->id());
-        int frame_b = Graph::getVertexFrameId(e->vertices()[1]->id());
-
-        if (abs(frame_a - frame_b) > 1 )
-        {
-
-          tf::Transform pose_0 = getVertexCameraPose(e->vertices()[0]->id(), false)*camera2odom_;
-          tf::Transform pose_1 = getVertexCameraPose(e->vertices()[1]->id(), false)*camera2odom_;
+        g2o::EdgeSE3* e = dynamic_cast<g2o::EdgeSE3*> (*it);
+        if (!e) continue;
 
-          // Extract the inliers
-          int inliers = 0;
-          for (uint i=0; i<edges_information_.size(); i++)
-          {
-            Edge ee = edges_information_[i];
-            if ( (ee.vertice_a == frame_a && ee.vertice_b == frame_b) ||
-                 (ee.vertice_a == frame_b && ee.vertice_b == frame_a) )
-            {
-              inliers = edges_information_[i].inliers;
-              break;
-            }
-          }
-
-          // Write
-          f_edges <<
-            e->vertices()[0]->id() << "," <<
-            e->vertices()[1]->id() << "," <<
-            inliers << "," <<
-            setprecision(6) <<
-            pose_0.getOrigin().x() << "," <<
-            pose_0.getOrigin().y() << "," <<
-            pose_0.getOrigin().z() << "," <<
-            pose_0.getRotation().x() << "," <<
-            pose_0.getRotation().y() << "," <<
-            pose_0.getRotation().z() << "," <<
-            pose_0.getRotation().w() << "," <<
-            pose_1.getOrigin().x() << "," <<
-            pose_1.getOrigin().y() << "," <<
-            pose_1.getOrigin().z() << "," <<
-            pose_1.getRotation().x() << "," <<
-            pose_1.getRotation().y() << "," <<
-            pose_1.getRotation().z() << "," <<
-            pose_1.getRotation().w() << endl;
-        }
+        // Get the frames corresponding to these edges
+        int vertex_a = e->vertices()[0]->id();
+        int vertex_b = e->vertices()[1]->id();
+        int frame_a = vertices_[vertex_a].frame_id;
+        int frame_b = vertices_[vertex_b].frame_id;
+        if (abs(frame_a - frame_b) <= 1) continue;
+
+        appendEdge(edges_data, vertex_a, vertex_b, frame_edges_.get(frame_a, frame_b),
+                   getVertexCameraPose(vertex_a, false)*camera2odom_, getVertexCameraPose(vertex_b, false)*camera2odom_);
       }
     }
-    f_edges.close();
 
-    // Un-lock
-    f_lock.close();
-    int ret_code = remove(lock_file.c_str());
-    if (ret_code != 0)
-      ROS_ERROR("[Localization:] Error deleting the locking file.");
+    // Format and replace the files
+    string vertices_data = VERTICES_HEADER;
+    formatVertices(frame_ids, stamps, poses, vertices_data);
+    if (writeFile(vertices_file_, vertices_data, false))
+    {
+      saved_frames_ = num_frames;
+      setSavedPoses(frame_ids, poses);
+    }
+    writeFile(edges_file_, edges_data, false);
   }
 
   void Graph::publishCameraPose(tf::Transform camera_pose)
@@ -662,55 +767,102 @@ namespace slam
     }
   }
 
+  // Fill the pose arrays of a graph poses message
+  template<class GraphMsg>
+  static void fillPoses(const vector<int>& ids, const vector<tf::Transform>& poses, GraphMsg& msg)
+  {
+    msg.id = ids;
+    msg.x.resize(poses.size());
+    msg.y.resize(poses.size());
+    msg.z.resize(poses.size());
+    msg.qx.resize(poses.size());
+    msg.qy.resize(poses.size());
+    msg.qz.resize(poses.size());
+    msg.qw.resize(poses.size());
+    for (uint i=0; i<poses.size(); i++)
+    {
+      const tf::Vector3& t = poses[i].getOrigin();
+      const tf::Quaternion q = poses[i].getRotation();
+      msg.x[i] = t.x();
+      msg.y[i] = t.y();
+      msg.z[i] = t.z();
+      msg.qx[i] = q.x();
+      msg.qy[i] = q.y();
+      msg.qz[i] = q.z();
+      msg.qw[i] = q.w();
+    }
+  }
+
   void Graph::publishGraph()
   {
     if (graph_pub_.getNumSubscribers() > 0)
     {
-      mutex::scoped_lock lock(mutex_graph_);
-
-      // Build the graph data
+      // Build the graph data (the poses are collected under the graph lock)
       vector<int> ids;
-      vector<double> x, y, z, qx, qy, qz, qw;
-      vector<int> processed_frames;
-      for (uint i=0; i<graph_optimizer_.vertices().size(); i++)
-      {
-        bool found = false;
-        int id = getVertexFrameId(i);
-        for (uint j=0; j<processed_frames.size(); j++)
-        {
-          if (processed_frames[j] == id)
-          {
-            found = true;
-            break;
-          }
-        }
-        if (found) continue;
-        processed_frames.push_back(id);
-
-        tf::Transform pose = getVertexCameraPose(i, false);
-        ids.push_back(id);
-        x.push_back(pose.getOrigin().x());
-        y.push_back(pose.getOrigin().y());
-        z.push_back(pose.getOrigin().z());
-        qx.push_back(pose.getRotation().x());
-        qy.push_back(pose.getRotation().y());
-        qz.push_back(pose.getRotation().z());
-        qw.push_back(pose.getRotation().w());
-      }
+      vector<tf::Transform> poses;
+      getFramePoses(0, ids, poses);
 
       // Publish
       stereo_slam::GraphPoses graph_msg;
       graph_msg.header.stamp = ros::Time::now();
-      graph_msg.id = ids;
-      graph_msg.x = x;
-      graph_msg.y = y;
-      graph_msg.z = z;
-      graph_msg.qx = qx;
-      graph_msg.qy = qy;
-      graph_msg.qz = qz;
-      graph_msg.qw = qw;
+      fillPoses(ids, poses, graph_msg);
       graph_pub_.publish(graph_msg);
     }
   }
 
+  void Graph::publishGraphDelta(bool only_new, bool snapshot)
+  {
+    mutex::scoped_lock lock(mutex_published_);
+
+    // Candidate frames: the new ones or all of them
+    vector<int> ids;
+    vector<tf::Transform> poses;
+    getFramePoses(only_new ? published_poses_.size() : 0, ids, poses);
+
+    // Keep the new frames and the frames that moved more than the tolerance
+    size_t n = 0;
+    for (size_t i=0; i<ids.size(); i++)
+    {
+      const int id = ids[i];
+      if (id >= (int)published_poses_.size())
+      {
+        published_poses_.resize(id + 1);
+        published_frames_.resize(id + 1, false);
+      }
+      if (!snapshot && published_frames_[id])
+      {
+        const tf::Transform& last = published_poses_[id];
+        bool moved = Tools::poseDiff3D(last, poses[i]) > GRAPH_DELTA_TRANS_TOL ||
+                     fabs(last.getRotation().angleShortestPath(poses[i].getRotation())) > GRAPH_DELTA_ROT_TOL;
+        if (!moved) continue;
+      }
+      published_poses_[id] = poses[i];
+      published_frames_[id] = true;
+      ids[n] = id;
+      poses[n] = poses[i];
+      n++;
+    }
+    ids.resize(n);
+    poses.resize(n);
+    if (n == 0 && !snapshot) return;
+
+    // Every delta has its version, even without subscribers, so the consumers can detect a gap
+    delta_version_++;
+    if (graph_delta_pub_.getNumSubscribers() > 0)
+    {
+      stereo_slam::GraphPosesDelta delta_msg;
+      delta_msg.header.stamp = ros::Time::now();
+      delta_msg.version = delta_version_;
+      delta_msg.snapshot = snapshot;
+      fillPoses(ids, poses, delta_msg);
+      graph_delta_pub_.publish(delta_msg);
+    }
+  }
+
+  bool Graph::publishSnapshot(std_srvs::Empty::Request&, std_srvs::Empty::Response&)
+  {
+    publishGraphDelta(false, true);
+    return true;
+  }
+
 } //namespace slam
@@ -0,0 +1,21 @@
+#include "keyframe.h"
+
+namespace slam
+{
+
+  KeyFrame::KeyFrame() : id_(-1), stamp_(0.0), num_inliers_with_prev_frame_(0) {}
+
+  KeyFrame::KeyFrame(const Frame& frame) :
+    id_(frame.getId()),
+    stamp_(frame.getTimestamp()),
+    camera_pose_(frame.getCameraPose()),
+    l_kp_(frame.getLeftKp()),
+    r_kp_(frame.getRightKp()),
+    l_desc_(frame.getLeftDesc()),
+    camera_points_(frame.getCameraPoints()),
+    clusters_(frame.getClusters()),
+    cluster_centroids_(frame.getClusterCentroids()),
+    num_inliers_with_prev_frame_(frame.getInliersNumWithPreviousFrame()),
+    information_with_prev_frame_(frame.getInformationWithPreviousFrame()) {}
+
+} //namespace slam
@@ -0,0 +1,78 @@
+#include "keypoint_grid.h"
+
+namespace slam
+{
+
+  KeypointGrid::KeypointGrid() : cell_size_(1.0), min_x_(0.0), min_y_(0.0), cols_(0), rows_(0) {}
+
+  KeypointGrid::KeypointGrid(const vector<cv::KeyPoint>& keypoints, float cell_size)
+    : cell_size_(cell_size), min_x_(0.0), min_y_(0.0), cols_(0), rows_(0)
+  {
+    if (keypoints.empty() || cell_size_ <= 0.0) return;
+
+    // Grid boundaries
+    points_.resize(keypoints.size());
+    float max_x = keypoints[0].pt.x;
+    float max_y = keypoints[0].pt.y;
+    min_x_ = max_x;
+    min_y_ = max_y;
+    for (uint i=0; i<keypoints.size(); i++)
+    {
+      points_[i] = keypoints[i].pt;
+      min_x_ = min(min_x_, points_[i].x);
+      min_y_ = min(min_y_, points_[i].y);
+      max_x = max(max_x, points_[i].x);
+      max_y = max(max_y, points_[i].y);
+    }
+    cols_ = toCell(max_x, min_x_) + 1;
+    rows_ = toCell(max_y, min_y_) + 1;
+
+    // Counting sort of the keypoints by cell (keeps the index order inside every cell)
+    vector<int> cells(points_.size());
+    cell_start_.assign(cols_*rows_ + 1, 0);
+    for (uint i=0; i<points_.size(); i++)
+    {
+      cells[i] = toCell(points_[i].y, min_y_) * cols_ + toCell(points_[i].x, min_x_);
+      cell_start_[cells[i] + 1]++;
+    }
+    for (int c=0; c<cols_*rows_; c++)
+      cell_start_[c + 1] += cell_start_[c];
+
+    vector<int> fill(cell_start_.begin(), cell_start_.end() - 1);
+    cell_indices_.resize(points_.size());
+    for (uint i=0; i<points_.size(); i++)
+      cell_indices_[fill[cells[i]]++] = i;
+  }
+
+  void KeypointGrid::radiusSearch(const cv::Point2f& center, float radius, vector<int>& indices) const
+  {
+    indices.clear();
+    if (points_.empty()) return;
+
+    int col_min = max(0, toCell(center.x - radius, min_x_));
+    int col_max = min(cols_ - 1, toCell(center.x + radius, min_x_));
+    int row_min = max(0, toCell(center.y - radius, min_y_));
+    int row_max = min(rows_ - 1, toCell(center.y + radius, min_y_));
+
+    const double sq_radius = (double)radius * radius;
+    for (int r=row_min; r<=row_max; r++)
+    {
+      for (int c=col_min; c<=col_max; c++)
+      {
+        int cell = r * cols_ + c;
+        for (int k=cell_start_[cell]; k<cell_start_[cell + 1]; k++)
+        {
+          int idx = cell_indices_[k];
+          double dx = points_[idx].x - center.x;
+          double dy = points_[idx].y - center.y;
+          if (dx*dx + dy*dy <= sq_radius)
+            indices.push_back(idx);
+        }
+      }
+    }
+
+    // Same order as a linear scan
+    sort(indices.begin(), indices.end());
+  }
+
+} //namespace slam
@@ -1,7 +1,9 @@
 #include <std_msgs/Int32.h>
+#include <std_msgs/Float32.h>
 #include <image_geometry/pinhole_camera_model.h>
 
 #include <numeric>
+#include <algorithm>
 
 #include "loop_closing.h"
 #include "tools.h"
@@ -17,6 +19,7 @@ namespace slam
     pub_num_keyframes_ = nhp.advertise<std_msgs::Int32>("keyframes", 2, true);
     pub_num_lc_ = nhp.advertise<std_msgs::Int32>("loop_closings", 2, true);
     pub_queue_ = nhp.advertise<std_msgs::Int32>("loop_closing_queue", 2, true);
+    pub_queue_age_ = nhp.advertise<std_msgs::Float32>("loop_closing_queue_age", 2, true);
     pub_matchings_num_ = nhp.advertise<std_msgs::Int32>("loop_closing_matches_num", 2, true);
     pub_inliers_num_ = nhp.advertise<std_msgs::Int32>("loop_closing_inliers_num", 2, true);
     pub_inliers_img_ = nhp.advertise<sensor_msgs::Image>("loop_closing_inliers_img", 2, true);
@@ -57,15 +60,21 @@ namespace slam
       pub_inliers_img_.publish(ros_image.toImageMsg());
     }
 
-    // Loop
-    ros::Rate r(50);
-    while(ros::ok())
+    // Wait for new clusters and process all the queued ones
+    vector<ClusterPtr> clusters;
+    double oldest_age;
+    while(ros::ok() && cluster_queue_.popAll(clusters, oldest_age))
     {
+      if (pub_queue_age_.getNumSubscribers() > 0)
+      {
+        std_msgs::Float32 msg;
+        msg.data = oldest_age;
+        pub_queue_age_.publish(msg);
+      }
 
-      // Process new frame
-      if(checkNewClusterInQueue())
+      for (uint i=0; i<clusters.size() && ros::ok(); i++)
       {
-        processNewCluster();
+        processNewCluster(clusters[i]);
 
         searchByProximity();
 
@@ -81,68 +90,61 @@ namespace slam
         if (pub_num_lc_.getNumSubscribers() > 0)
         {
           std_msgs::Int32 msg;
-          msg.data = lexical_cast<int>(cluster_lc_found_.size());
+          msg.data = lexical_cast<int>(cluster_loop_closings_.size());
           pub_num_lc_.publish(msg);
         }
         if (pub_queue_.getNumSubscribers() > 0)
         {
-          mutex::scoped_lock lock(mutex_cluster_queue_);
+          // Clusters of the batch still to be processed plus the new queued ones
           std_msgs::Int32 msg;
-          msg.data = lexical_cast<int>(cluster_queue_.size());
+          msg.data = lexical_cast<int>(clusters.size() - i - 1 + cluster_queue_.size());
           pub_queue_.publish(msg);
         }
       }
-
-      r.sleep();
     }
-  }
 
-  void LoopClosing::addClusterToQueue(Cluster cluster)
-  {
-    mutex::scoped_lock lock(mutex_cluster_queue_);
-    cluster_queue_.push_back(cluster);
+    // Remove the temporal directory
+    if (fs::is_directory(execution_dir_))
+      fs::remove_all(execution_dir_);
   }
 
-  bool LoopClosing::checkNewClusterInQueue()
+  void LoopClosing::addClusterToQueue(const ClusterPtr& cluster)
   {
-    mutex::scoped_lock lock(mutex_cluster_queue_);
-    return(!cluster_queue_.empty());
+    cluster_queue_.push(cluster);
   }
 
-  void LoopClosing::processNewCluster()
+  void LoopClosing::processNewCluster(const ClusterPtr& cluster)
   {
-    // Get the cluster
-    {
-      mutex::scoped_lock lock(mutex_cluster_queue_);
-      c_cluster_ = cluster_queue_.front();
-      cluster_queue_.pop_front();
-    }
+    c_cluster_ = cluster;
+
+    // The hash is computed from the cluster descriptors (no need to describe the keypoints again)
+    cv::Mat hash_desc = FeatureExtractor::toFloatDescriptors(c_cluster_->getDesc());
 
     // Initialize hash
     if (!hash_.isInitialized())
-      hash_.init(c_cluster_.getSift());
+      hash_.init(hash_desc);
 
     // Save hash to table
-    hash_table_.push_back(make_pair(c_cluster_.getId(), hash_.getHash(c_cluster_.getSift())));
+    hash_table_.push_back(make_pair(c_cluster_->getId(), hash_.getHash(hash_desc)));
 
     // Store
-    cv::FileStorage fs(execution_dir_+"/"+lexical_cast<string>(c_cluster_.getId())+".yml", cv::FileStorage::WRITE);
-    write(fs, "frame_id", c_cluster_.getFrameId());
-    write(fs, "kp_l", c_cluster_.getLeftKp());
-    write(fs, "kp_r", c_cluster_.getRightKp());
-    write(fs, "desc", c_cluster_.getOrb());
-    write(fs, "points", c_cluster_.getPoints());
+    cv::FileStorage fs(execution_dir_+"/"+lexical_cast<string>(c_cluster_->getId())+".yml", cv::FileStorage::WRITE);
+    write(fs, "frame_id", c_cluster_->getFrameId());
+    write(fs, "kp_l", c_cluster_->getLeftKp());
+    write(fs, "kp_r", c_cluster_->getRightKp());
+    write(fs, "desc", c_cluster_->getDesc());
+    write(fs, "points", c_cluster_->getPoints());
     fs.release();
   }
 
   void LoopClosing::searchByProximity()
   {
     vector<int> cand_neighbors;
-    graph_->findClosestVertices(c_cluster_.getId(), c_cluster_.getId(), LC_DISCARD_WINDOW, 3, cand_neighbors);
+    graph_->findClosestVertices(c_cluster_->getId(), c_cluster_->getId(), LC_DISCARD_WINDOW, 3, cand_neighbors);
     for (uint i=0; i<cand_neighbors.size(); i++)
     {
       Cluster candidate = readCluster(cand_neighbors[i]);
-      if (candidate.getOrb().rows == 0)
+      if (candidate.getDesc().rows == 0)
         continue;
 
       closeLoopWithCluster(candidate, "proximity");
@@ -153,14 +155,14 @@ namespace slam
   {
     // Get the candidates to close loop
     vector< pair<int,float> > hash_matching;
-    getCandidates(c_cluster_.getId(), hash_matching);
+    getCandidates(c_cluster_->getId(), hash_matching);
     if (hash_matching.size() == 0) return;
 
     // Loop over candidates
     for (uint i=0; i<hash_matching.size(); i++)
     {
       Cluster candidate = readCluster(hash_matching[i].first);
-      if (candidate.getOrb().rows == 0)
+      if (candidate.getDesc().rows == 0)
         continue;
 
       bool valid = closeLoopWithCluster(candidate, "hash");
@@ -169,14 +171,14 @@ namespace slam
     }
   }
 
-  bool LoopClosing::closeLoopWithCluster(Cluster candidate, string search_method)
+  bool LoopClosing::closeLoopWithCluster(const Cluster& candidate, const string& search_method)
   {
     // Init
     const float matching_th = 0.7;
 
     // Descriptor matching
     vector<cv::DMatch> matches_1;
-    Tools::ratioMatching(c_cluster_.getOrb(), candidate.getOrb(), matching_th, matches_1);
+    Tools::ratioMatching(c_cluster_->getDesc(), candidate.getDesc(), matching_th, matches_1);
 
     // Get the neighbor clusters if enough matching percentage
     if (matches_1.size() > (int)(LC_MIN_INLIERS / 2))
@@ -186,15 +188,15 @@ namespace slam
       vector<int> cluster_cand_list;
 
       // Candidate data
-      cv::Mat all_cand_desc = candidate.getOrb();
+      cv::Mat all_cand_desc = candidate.getDesc();
       vector<cv::Point3f> all_cand_points = candidate.getWorldPoints();
       vector<cv::KeyPoint> all_cand_kp_l = candidate.getLeftKp();
       vector<cv::KeyPoint> all_cand_kp_r = candidate.getRightKp();
 
       // Query data
-      cv::Mat all_query_desc = c_cluster_.getOrb();
-      vector<cv::KeyPoint> all_query_kp_l = c_cluster_.getLeftKp();
-      vector<cv::KeyPoint> all_query_kp_r = c_cluster_.getRightKp();
+      cv::Mat all_query_desc = c_cluster_->getDesc();
+      vector<cv::KeyPoint> all_query_kp_l = c_cluster_->getLeftKp();
+      vector<cv::KeyPoint> all_query_kp_r = c_cluster_->getRightKp();
 
       // Init the cluster candidate list
       for (uint j=0; j<all_cand_points.size(); j++)
@@ -202,16 +204,16 @@ namespace slam
 
       // Increase the probability to close loop by extracting the candidate neighbors
       vector<int> cand_neighbors;
-      graph_->findClosestVertices(candidate.getId(), c_cluster_.getId(), LC_DISCARD_WINDOW, LC_NEIGHBORS, cand_neighbors);
+      graph_->findClosestVertices(candidate.getId(), c_cluster_->getId(), LC_DISCARD_WINDOW, LC_NEIGHBORS, cand_neighbors);
       for (uint j=0; j<cand_neighbors.size(); j++)
       {
         Cluster cand_neighbor = readCluster(cand_neighbors[j]);
-        cv::Mat c_n_desc = cand_neighbor.getOrb();
+        cv::Mat c_n_desc = cand_neighbor.getDesc();
         if (c_n_desc.rows == 0) continue;
 
         vector<cv::Point3f> points_tmp = cand_neighbor.getWorldPoints();
-        vector<cv::KeyPoint> kp_tmp_l = cand_neighbor.getLeftKp();
-        vector<cv::KeyPoint> kp_tmp_r = cand_neighbor.getRightKp();
+        const vector<cv::KeyPoint>& kp_tmp_l = cand_neighbor.getLeftKp();
+        const vector<cv::KeyPoint>& kp_tmp_r = cand_neighbor.getRightKp();
 
         // Concatenate descriptors and points
         cv::vconcat(all_cand_desc, c_n_desc, all_cand_desc);
@@ -225,25 +227,25 @@ namespace slam
       }
 
       // Init the cluster frame list
-      for (uint j=0; j<c_cluster_.getLeftKp().size(); j++)
-        cluster_query_list.push_back(c_cluster_.getId());
+      for (uint j=0; j<c_cluster_->getLeftKp().size(); j++)
+        cluster_query_list.push_back(c_cluster_->getId());
 
       // Extract all the clusters corresponding to the current cluster frame
       vector<int> query_clusters;
-      graph_->getFrameVertices(c_cluster_.getFrameId(), query_clusters);
+      graph_->getFrameVertices(c_cluster_->getFrameId(), query_clusters);
       for (uint j=0; j<query_clusters.size(); j++)
       {
-        if (query_clusters[j] == c_cluster_.getId())
+        if (query_clusters[j] == c_cluster_->getId())
           continue;
 
         Cluster query_cluster = readCluster(query_clusters[j]);
-        cv::Mat f_n_desc = query_cluster.getOrb();
+        cv::Mat f_n_desc = query_cluster.getDesc();
         if (f_n_desc.rows == 0) continue;
 
         // Concatenate descriptors and keypoints
         cv::vconcat(all_query_desc, f_n_desc, all_query_desc);
-        vector<cv::KeyPoint> query_n_kp_l = query_cluster.getLeftKp();
-        vector<cv::KeyPoint> query_n_kp_r = query_cluster.getRightKp();
+        const vector<cv::KeyPoint>& query_n_kp_l = query_cluster.getLeftKp();
+        const vector<cv::KeyPoint>& query_n_kp_r = query_cluster.getRightKp();
         all_query_kp_l.insert(all_query_kp_l.end(), query_n_kp_l.begin(), query_n_kp_l.end());
         all_query_kp_r.insert(all_query_kp_r.end(), query_n_kp_r.begin(), query_n_kp_r.end());
 
@@ -271,6 +273,7 @@ namespace slam
         vector<cv::Point2f> matched_query_kp_l, matched_query_kp_r;
         vector<cv::Point2f> matched_cand_kp_l, matched_cand_kp_r;
         vector<cv::Point3f> matched_cand_3d_points;
+        vector<float> matching_quality;
         for(uint j=0; j<matches_2.size(); j++)
         {
           // Features
@@ -281,18 +284,18 @@ namespace slam
 
           // 3d
           matched_cand_3d_points.push_back(all_cand_points[matches_2[j].trainIdx]);
+          matching_quality.push_back(matches_2[j].distance);
 
           // Ids
           query_matchings.push_back(cluster_query_list[matches_2[j].queryIdx]);
           cand_matchings.push_back(cluster_cand_list[matches_2[j].trainIdx]);
         }
 
-        // Estimate the motion
+        // Estimate the motion and its information matrix (closest descriptors sampled first)
         vector<int> inliers;
-        cv::Mat rvec, tvec;
-        cv::solvePnPRansac(matched_cand_3d_points, matched_query_kp_l,
-            graph_->getCameraMatrix(), cv::Mat(), rvec, tvec,
-            false, 100, LC_EPIPOLAR_THRESH, 0.99, inliers, cv::SOLVEPNP_ITERATIVE);
+        cv::Mat rvec, tvec, information;
+        pose_solver_.solve(matched_cand_3d_points, matched_query_kp_l, graph_->getCameraMatrix(),
+                           matching_quality, rvec, tvec, inliers, information);
 
         if (pub_inliers_num_.getNumSubscribers() > 0)
         {
@@ -363,37 +366,17 @@ namespace slam
           {
             if (inliers_per_pair[i] >= 5)
             {
-              // Check if this frame exists
-              bool lc_found = false;
-              for (uint l=0; l<cluster_lc_found_.size(); l++)
-              {
-                if ( (cluster_lc_found_[l].first == cluster_pairs[i][0] && cluster_lc_found_[l].second == cluster_pairs[i][1]) ||
-                    (cluster_lc_found_[l].first == cluster_pairs[i][1] && cluster_lc_found_[l].second == cluster_pairs[i][0]) )
-                {
-                  lc_found = true;
-                  break;
-                }
-              }
-              if (lc_found) continue;
+              // Check if this loop closure already exists
+              if (cluster_loop_closings_.contains(cluster_pairs[i][0], cluster_pairs[i][1])) continue;
 
               // Compute correct transform between edges
               tf::Transform candidate_cluster_pose = graph_->getVertexPose(cluster_pairs[i][1]);
               tf::Transform frame_cluster_pose_relative_to_camera = graph_->getVertexPoseRelativeToCamera(cluster_pairs[i][0]);
               tf::Transform edge_1 = candidate_cluster_pose.inverse() * estimated_transform * frame_cluster_pose_relative_to_camera;
 
-              // Estimate the covariance
-              cv::Mat J;
-              cv::Mat sigma;
-              vector<cv::Point2f> p;
-              vector<cv::Point3f> inliers_3d_points;
-              for (uint i=0; i<inliers.size(); i++)
-                inliers_3d_points.push_back(matched_cand_3d_points[inliers[i]]);
-              cv::projectPoints(inliers_3d_points, rvec, tvec, graph_->getCameraMatrix(), cv::Mat(), p, J);
-              cv::Mat tmp = cv::Mat(J.t() * J, cv::Rect(0,0,6,6)).inv();
-              cv::sqrt(cv::abs(tmp), sigma);
-
-              // Add this edge to the graph
-              graph_->addEdge(cluster_pairs[i][1], cluster_pairs[i][0], edge_1, sigma, inliers_per_pair[i]);
+              // Add this edge to the graph. The information of the camera pose is moved to the query cluster frame
+              cv::Mat edge_information = Tools::transformInformation(information, frame_cluster_pose_relative_to_camera);
+              graph_->addEdge(cluster_pairs[i][1], cluster_pairs[i][0], edge_1, edge_information, inliers_per_pair[i]);
               vector<int> pair;
               pair.push_back(cluster_pairs[i][0]);
               pair.push_back(cluster_pairs[i][1]);
@@ -402,7 +385,7 @@ namespace slam
               some_edge_added = true;
 
               // Add this edge to the cluster list of loop closings found
-              cluster_lc_found_.push_back(make_pair(cluster_pairs[i][0], cluster_pairs[i][1]));
+              cluster_loop_closings_.add(cluster_pairs[i][0], cluster_pairs[i][1], inliers_per_pair[i]);
             }
           }
 
@@ -424,7 +407,7 @@ namespace slam
 
             ROS_INFO("[Localization:] ---------------------------");
             ROS_INFO_STREAM("[Localization:]      LOOP CLOSURE " << num_loop_closures_);
-            ROS_INFO_STREAM("[Localization:] Between keyframe " << c_cluster_.getFrameId() << " AND " << candidate.getFrameId() );
+            ROS_INFO_STREAM("[Localization:] Between keyframe " << c_cluster_->getFrameId() << " AND " << candidate.getFrameId() );
             ROS_INFO_STREAM("[Localization:] Method: " << search_method);
             ROS_INFO_STREAM("[Localization:] Inliers: " << inliers.size());
             ROS_INFO("[Localization:] ---------------------------");
@@ -448,13 +431,8 @@ namespace slam
 
     // Create a list with the non-possible candidates (because they are already loop closings)
     vector<int> no_candidates;
-    for (uint i=0; i<cluster_lc_found_.size(); i++)
-    {
-      if (cluster_lc_found_[i].first == cluster_id)
-        no_candidates.push_back(cluster_lc_found_[i].second);
-      if (cluster_lc_found_[i].second == cluster_id)
-        no_candidates.push_back(cluster_lc_found_[i].first);
-    }
+    cluster_loop_closings_.getNeighbors(cluster_id, no_candidates);
+    sort(no_candidates.begin(), no_candidates.end());
 
     // Query hash
     vector<float> hash_q = hash_table_[cluster_id].second;
@@ -470,7 +448,7 @@ namespace slam
       if (hash_table_[i].first == cluster_id) continue;
 
       // Continue if candidate is in the no_candidates list
-      if (find(no_candidates.begin(), no_candidates.end(), hash_table_[i].first) != no_candidates.end())
+      if (binary_search(no_candidates.begin(), no_candidates.end(), hash_table_[i].first))
         continue;
 
       // Hash matching
@@ -503,7 +481,7 @@ namespace slam
 
     int frame_id;
     vector<cv::KeyPoint> kp_l, kp_r;
-    cv::Mat desc, pose, empty;
+    cv::Mat desc, pose;
     vector<cv::Point3f> points;
     fs["frame_id"] >> frame_id;
     fs["desc"] >> desc;
@@ -516,10 +494,7 @@ namespace slam
 
     // Set the properties of the cluster
     tf::Transform vertex_camera_pose = graph_->getVertexCameraPose(id, true);
-    Cluster cluster_tmp(id, frame_id, vertex_camera_pose, kp_l, kp_r, desc, empty, points);
-    cluster = cluster_tmp;
-
-    return cluster;
+    return Cluster(id, frame_id, vertex_camera_pose, std::move(kp_l), std::move(kp_r), desc, std::move(points));
   }
 
   void LoopClosing::drawLoopClosure(vector<int> cand_kfs,
@@ -562,13 +537,13 @@ namespace slam
     }
 
     // Read the current keyframe
-    string frame_id_str = Tools::convertTo5digits(c_cluster_.getFrameId());
+    string frame_id_str = Tools::convertTo5digits(c_cluster_->getFrameId());
     string keyframe_file = WORKING_DIRECTORY + "keyframes/" + frame_id_str + ".jpg";
     cv::Mat current_kf_tmp = cv::imread(keyframe_file, CV_LOAD_IMAGE_COLOR);
 
     // Add the keyframe identifier
     stringstream s;
-    s << " Keyframe " << c_cluster_.getFrameId() << " has " << inliers.size() << " inliers.";
+    s << " Keyframe " << c_cluster_->getFrameId() << " has " << inliers.size() << " inliers.";
     cv::Size text_size = cv::getTextSize(s.str(), cv::FONT_HERSHEY_PLAIN, 1, 1, &baseline);
     cv::Mat current_kf_text = cv::Mat(current_kf_tmp.rows + text_size.height + 10, current_kf_tmp.cols, current_kf_tmp.type());
     current_kf_tmp.copyTo(current_kf_text.rowRange(text_size.height + 10, current_kf_tmp.rows + text_size.height + 10).colRange(0, current_kf_tmp.cols));
@@ -657,9 +632,8 @@ namespace slam
 
   void LoopClosing::finalize()
   {
-    // Remove the temporal directory
-    if (fs::is_directory(execution_dir_))
-      fs::remove_all(execution_dir_);
+    // The thread removes the temporal directory once it stops
+    cluster_queue_.close();
   }
 
 } //namespace slam
@@ -5,6 +5,7 @@
 #include "constants.h"
 #include "publisher.h"
 #include "tracking.h"
+#include "feature_extractor.h"
 #include "graph.h"
 #include "loop_closing.h"
 
@@ -18,6 +19,18 @@ void readTrackingParams(slam::Tracking::Params &tracking_params)
   nhp.param("odom_topic",   tracking_params.odom_topic,   string(""));
   nhp.param("camera_topic", tracking_params.camera_topic, string(""));
   nhp.param("refine",       tracking_params.refine,       false);
+  nhp.param("mono_images",  tracking_params.mono_images,  false);
+  nhp.param("overlap_stride", tracking_params.overlap_stride, 1);
+}
+
+/** \brief Read the feature extractor parameters
+  */
+void readFeatureExtractorParams(slam::FeatureExtractor::Params &feature_params)
+{
+  ros::NodeHandle nhp("~");
+  nhp.param("feature_type", feature_params.type, string("SIFT"));
+  nhp.param("feature_scale", feature_params.scale, 1.0);
+  nhp.param("max_keypoints", feature_params.max_keypoints, 0);
 }
 
 /** \brief Main entry point
@@ -43,17 +56,23 @@ int main(int argc, char **argv)
   // For debugging purposes
   slam::Publisher publisher;
 
+  // Feature extraction
+  slam::FeatureExtractor feature_extractor;
+
   // Threads
   slam::LoopClosing loop_closing;
   slam::Graph graph(&loop_closing);
-  slam::Tracking tracker(&publisher, &graph);
+  slam::Tracking tracker(&publisher, &graph, &feature_extractor);
 
   // Read parameters
   slam::Tracking::Params tracking_params;
   readTrackingParams(tracking_params);
+  slam::FeatureExtractor::Params feature_params;
+  readFeatureExtractorParams(feature_params);
 
   // Set the parameters for every object
   tracker.setParams(tracking_params);
+  feature_extractor.setParams(feature_params);
   loop_closing.setGraph(&graph);
 
   // Launch threads
@@ -68,8 +87,12 @@ int main(int argc, char **argv)
     r.sleep();
   }
 
-  // Loop closing object is the only one that needs finalization
+  // Close the graph and loop closing queues so their threads stop waiting
+  graph.finalize();
+  trackingThread.join();
+  graphThread.join();
   loop_closing.finalize();
+  loopClosingThread.join();
 
   ros::shutdown();
 
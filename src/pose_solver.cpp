@@ -0,0 +1,252 @@
+#include <algorithm>
+#include <cmath>
+
+#include "pose_solver.h"
+
+namespace slam
+{
+
+#if CV_VERSION_MAJOR > 3 || (CV_VERSION_MAJOR == 3 && CV_VERSION_MINOR >= 3)
+  static const int MINIMAL_SOLVER = cv::SOLVEPNP_AP3P;
+#else
+  static const int MINIMAL_SOLVER = cv::SOLVEPNP_P3P;
+#endif
+
+  // Sort the correspondence indices by quality (lower first)
+  struct QualityOrder
+  {
+    const vector<float>& quality;
+    QualityOrder(const vector<float>& q) : quality(q) {}
+    bool operator()(int a, int b) const {return quality[a] < quality[b] || (quality[a] == quality[b] && a < b);}
+  };
+
+  PoseSolver::PoseSolver() : fx_(0.0), fy_(0.0), cx_(0.0), cy_(0.0) {}
+
+  bool PoseSolver::solve(const vector<cv::Point3f>& points, const vector<cv::Point2f>& kp, const cv::Mat& camera_matrix,
+                         const vector<float>& quality, cv::Mat& rvec, cv::Mat& tvec, vector<int>& inliers, cv::Mat& information)
+  {
+    // The minimal solver needs 3 points plus 1 to disambiguate
+    const int sample_size = 4;
+    const int n = points.size();
+    inliers.clear();
+    if (n < sample_size || (int)kp.size() != n)
+      return false;
+
+    // Contiguous copies of the correspondences
+    x_.resize(n); y_.resize(n); z_.resize(n);
+    u_.resize(n); v_.resize(n);
+    inlier_mask_.resize(n);
+    for (int i=0; i<n; i++)
+    {
+      x_[i] = points[i].x;
+      y_[i] = points[i].y;
+      z_[i] = points[i].z;
+      u_[i] = kp[i].x;
+      v_[i] = kp[i].y;
+    }
+    fx_ = camera_matrix.at<double>(0, 0);
+    fy_ = camera_matrix.at<double>(1, 1);
+    cx_ = camera_matrix.at<double>(0, 2);
+    cy_ = camera_matrix.at<double>(1, 2);
+
+    // PROSAC ordering: best correspondences first
+    vector<int> order(n);
+    for (int i=0; i<n; i++)
+      order[i] = i;
+    if ((int)quality.size() == n)
+      sort(order.begin(), order.end(), QualityOrder(quality));
+
+    // The sampling pool grows from the best correspondences to all of them in the first half of the iterations
+    const int max_iterations = max(1, params_.max_iterations);
+    const int growth_iterations = max(1, max_iterations / 2);
+
+    cv::RNG rng(0x12345678);
+    vector<cv::Point3f> sample_points(sample_size);
+    vector<cv::Point2f> sample_kp(sample_size);
+    cv::Mat best_rvec, best_tvec;
+    int best_score = 0;
+    int iterations = max_iterations;
+    for (int it=0; it<iterations; it++)
+    {
+      int pool = min(n, sample_size + (it * (n - sample_size)) / growth_iterations);
+
+      // Sample: while the pool grows, the newest correspondence of the pool and 3 other random ones. Once
+      // the pool holds all the correspondences, 4 random ones (plain RANSAC).
+      int sample[sample_size];
+      int first = 0;
+      if (pool < n)
+      {
+        sample[0] = pool - 1;
+        first = 1;
+      }
+      for (int s=first; s<sample_size; s++)
+      {
+        bool repeated = true;
+        while (repeated)
+        {
+          sample[s] = rng.uniform(0, pool);
+          repeated = false;
+          for (int k=0; k<s; k++)
+            repeated = repeated || sample[k] == sample[s];
+        }
+      }
+      for (int s=0; s<sample_size; s++)
+      {
+        sample_points[s] = points[order[sample[s]]];
+        sample_kp[s] = kp[order[sample[s]]];
+      }
+
+      // Minimal solver
+      cv::Mat r, t;
+      bool valid = false;
+      try
+      {
+        valid = cv::solvePnP(sample_points, sample_kp, camera_matrix, cv::Mat(), r, t, false, MINIMAL_SOLVER);
+      }
+      catch (cv::Exception& e)
+      {
+        valid = false;
+      }
+      if (!valid || r.empty() || t.empty()) continue;
+
+      int num_inliers = score(r, t, NULL);
+      if (num_inliers > best_score)
+      {
+        best_score = num_inliers;
+        best_rvec = r;
+        best_tvec = t;
+
+        // Adaptive number of iterations
+        if (num_inliers == n) break;
+        double w = (double)num_inliers / n;
+        double p_fail = 1.0 - pow(w, sample_size);
+        if (p_fail > 0.0 && p_fail < 1.0)
+        {
+          double k = log(1.0 - params_.confidence) / log(p_fail);
+          iterations = min(iterations, max(it + 1, (int)ceil(k)));
+        }
+      }
+    }
+
+    if (best_score < sample_size)
+      return false;
+
+    // Levenberg-Marquardt refinement on the inliers
+    score(best_rvec, best_tvec, &inliers);
+    vector<cv::Point3f> inliers_points;
+    vector<cv::Point2f> inliers_kp;
+    inliers_points.reserve(inliers.size());
+    inliers_kp.reserve(inliers.size());
+    for (uint i=0; i<inliers.size(); i++)
+    {
+      inliers_points.push_back(points[inliers[i]]);
+      inliers_kp.push_back(kp[inliers[i]]);
+    }
+    rvec = best_rvec.clone();
+    tvec = best_tvec.clone();
+    cv::solvePnP(inliers_points, inliers_kp, camera_matrix, cv::Mat(), rvec, tvec, true, cv::SOLVEPNP_ITERATIVE);
+
+    // Keep the refined pose only if it does not lose inliers
+    vector<int> refined_inliers;
+    if (score(rvec, tvec, &refined_inliers) >= (int)inliers.size())
+    {
+      inliers.swap(refined_inliers);
+    }
+    else
+    {
+      rvec = best_rvec;
+      tvec = best_tvec;
+    }
+    if ((int)inliers.size() < sample_size)
+      return false;
+
+    computeInformation(rvec, tvec, inliers, information);
+    return true;
+  }
+
+  void PoseSolver::computeInformation(const cv::Mat& rvec, const cv::Mat& tvec, const vector<int>& inliers,
+                                      cv::Mat& information)
+  {
+    cv::Mat R;
+    cv::Rodrigues(rvec, R);
+    cv::Mat t;
+    tvec.convertTo(t, CV_64F);
+
+    // Accumulate the upper triangle of J^T * J, where J is the 2x6 jacobian of the projection of every
+    // inlier with respect to a (translation, rotation) perturbation of the camera point: dPc = dt + dr x Pc
+    double H[6][6] = {{0.0}};
+    for (uint k=0; k<inliers.size(); k++)
+    {
+      const int i = inliers[k];
+      const double X = R.at<double>(0,0)*x_[i] + R.at<double>(0,1)*y_[i] + R.at<double>(0,2)*z_[i] + t.at<double>(0);
+      const double Y = R.at<double>(1,0)*x_[i] + R.at<double>(1,1)*y_[i] + R.at<double>(1,2)*z_[i] + t.at<double>(1);
+      const double Z = R.at<double>(2,0)*x_[i] + R.at<double>(2,1)*y_[i] + R.at<double>(2,2)*z_[i] + t.at<double>(2);
+      const double inv_z = 1.0 / Z;
+      const double x = X * inv_z;
+      const double y = Y * inv_z;
+      const double ju[6] = {fx_ * inv_z, 0.0, -fx_ * x * inv_z, -fx_ * x * y, fx_ * (1.0 + x * x), -fx_ * y};
+      const double jv[6] = {0.0, fy_ * inv_z, -fy_ * y * inv_z, -fy_ * (1.0 + y * y), fy_ * x * y, fy_ * x};
+      for (int r=0; r<6; r++)
+        for (int c=r; c<6; c++)
+          H[r][c] += ju[r] * ju[c] + jv[r] * jv[c];
+    }
+
+    information.create(6, 6, CV_64F);
+    for (int r=0; r<6; r++)
+    {
+      for (int c=r; c<6; c++)
+      {
+        information.at<double>(r, c) = H[r][c];
+        information.at<double>(c, r) = H[r][c];
+      }
+    }
+  }
+
+  int PoseSolver::score(const cv::Mat& rvec, const cv::Mat& tvec, vector<int>* inliers)
+  {
+    cv::Mat R;
+    cv::Rodrigues(rvec, R);
+    cv::Mat t;
+    tvec.convertTo(t, CV_64F);
+    const float r00 = R.at<double>(0,0), r01 = R.at<double>(0,1), r02 = R.at<double>(0,2);
+    const float r10 = R.at<double>(1,0), r11 = R.at<double>(1,1), r12 = R.at<double>(1,2);
+    const float r20 = R.at<double>(2,0), r21 = R.at<double>(2,1), r22 = R.at<double>(2,2);
+    const float t0 = t.at<double>(0), t1 = t.at<double>(1), t2 = t.at<double>(2);
+    const float fx = fx_, fy = fy_, cx = cx_, cy = cy_;
+    const float thresh_sq = params_.reprojection_error * params_.reprojection_error;
+
+    const int n = x_.size();
+    const float* x = x_.data();
+    const float* y = y_.data();
+    const float* z = z_.data();
+    const float* u = u_.data();
+    const float* v = v_.data();
+    uchar* mask = inlier_mask_.data();
+    int count = 0;
+    for (int i=0; i<n; i++)
+    {
+      float px = r00*x[i] + r01*y[i] + r02*z[i] + t0;
+      float py = r10*x[i] + r11*y[i] + r12*z[i] + t1;
+      float pz = r20*x[i] + r21*y[i] + r22*z[i] + t2;
+      float inv_z = 1.0f / pz;
+      float du = fx * px * inv_z + cx - u[i];
+      float dv = fy * py * inv_z + cy - v[i];
+      uchar inlier = (pz > 0.0f) & (du*du + dv*dv < thresh_sq);
+      mask[i] = inlier;
+      count += inlier;
+    }
+
+    if (inliers)
+    {
+      inliers->clear();
+      inliers->reserve(count);
+      for (int i=0; i<n; i++)
+      {
+        if (mask[i])
+          inliers->push_back(i);
+      }
+    }
+    return count;
+  }
+
+} // namespace
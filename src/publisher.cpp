@@ -14,33 +14,38 @@ namespace slam
     pub_stereo_matches_num_ = nhp.advertise<std_msgs::Int32>("stereo_matches_num", 2, true);
   }
 
-  void Publisher::publishClustering(const Frame frame)
+  void Publisher::publishClustering(const Frame& frame)
   {
     if (pub_clustering_.getNumSubscribers() > 0)
       drawKeypointsClustering(frame);
   }
 
-  void Publisher::publishStereoMatches(const Frame frame)
+  void Publisher::publishStereoMatches(const Frame& frame)
   {
-    if (pub_stereo_matches_img_.getNumSubscribers() > 0 ||
-        pub_stereo_matches_num_.getNumSubscribers() > 0)
+    if (hasStereoMatchesSubscribers())
       drawStereoMatches(frame);
   }
 
-  void Publisher::drawKeypointsClustering(const Frame frame)
+  bool Publisher::hasStereoMatchesSubscribers() const
   {
-    vector< vector<int> > clusters = frame.getClusters();
+    return pub_stereo_matches_img_.getNumSubscribers() > 0 ||
+           pub_stereo_matches_num_.getNumSubscribers() > 0;
+  }
+
+  void Publisher::drawKeypointsClustering(const Frame& frame)
+  {
+    const ClusterSet& clusters = frame.getClusters();
     if (clusters.size() == 0) return;
 
     cv::Mat img;
     frame.getLeftImg().copyTo(img);
-    vector<cv::KeyPoint> kp = frame.getLeftKp();
+    const vector<cv::KeyPoint>& kp = frame.getLeftKp();
     cv::RNG rng(12345);
-    for (uint i=0; i<clusters.size(); i++)
+    for (int i=0; i<clusters.size(); i++)
     {
       cv::Scalar color = cv::Scalar(rng.uniform(0,255), rng.uniform(0, 255), rng.uniform(0, 255));
-      for (uint j=0; j<clusters[i].size(); j++)
-        cv::circle(img, kp[clusters[i][j]].pt, 5, color, -1);
+      for (const int* it=clusters.begin(i); it!=clusters.end(i); ++it)
+        cv::circle(img, kp[*it].pt, 5, color, -1);
     }
 
     // Draw text
@@ -61,14 +66,14 @@ namespace slam
     pub_clustering_.publish(ros_image.toImageMsg());
   }
 
-  void Publisher::drawStereoMatches(const Frame frame)
+  void Publisher::drawStereoMatches(const Frame& frame)
   {
     cv::Mat out;
     cv::Mat l_img = frame.getLeftImg();
     cv::Mat r_img = frame.getRightImg();
-    vector<cv::KeyPoint> l_kp = frame.getNonFilteredLeftKp();
-    vector<cv::KeyPoint> r_kp = frame.getNonFilteredRightKp();
-    vector<cv::DMatch> matches = frame.getMatches();
+    const vector<cv::KeyPoint>& l_kp = frame.getNonFilteredLeftKp();
+    const vector<cv::KeyPoint>& r_kp = frame.getNonFilteredRightKp();
+    const vector<cv::DMatch>& matches = frame.getMatches();
 
     if (pub_stereo_matches_img_.getNumSubscribers() > 0)
     {
@@ -0,0 +1,177 @@
+#include <limits>
+
+#include "top2_matcher.h"
+
+namespace slam
+{
+
+  // Search the two nearest train descriptors of a range of query descriptors and apply the ratio test.
+  // The result of every query is written in its own slot (trainIdx = -1 when rejected).
+  template<class Distance>
+  class Top2Body : public cv::ParallelLoopBody
+  {
+  public:
+    typedef typename Distance::ElementType ElementType;
+    typedef typename Distance::ResultType ResultType;
+
+    Top2Body(const cv::Mat& desc_1, const cv::Mat& desc_2, const cv::Mat& mask,
+             double ratio, bool strict, cv::DMatch* out) :
+      desc_1_(desc_1), desc_2_(desc_2), mask_(mask), ratio_(Distance::toSquared(ratio)), strict_(strict), out_(out) {}
+
+    virtual void operator()(const cv::Range& range) const
+    {
+      const int cols = desc_1_.cols;
+      for (int i=range.start; i<range.end; i++)
+      {
+        const ElementType* query = desc_1_.ptr<ElementType>(i);
+        const uchar* mask_row = mask_.empty() ? NULL : mask_.ptr<uchar>(i);
+        ResultType best = numeric_limits<ResultType>::max();
+        ResultType second = numeric_limits<ResultType>::max();
+        int best_idx = -1;
+        for (int j=0; j<desc_2_.rows; j++)
+        {
+          if (mask_row && !mask_row[j]) continue;
+          ResultType d = Distance::distance(query, desc_2_.ptr<ElementType>(j), cols);
+          if (d < best)
+          {
+            second = best;
+            best = d;
+            best_idx = j;
+          }
+          else if (d < second)
+          {
+            second = d;
+          }
+        }
+
+        cv::DMatch& m = out_[i];
+        m.queryIdx = i;
+        m.trainIdx = -1;
+        if (best_idx < 0 || second == numeric_limits<ResultType>::max()) continue;
+        bool valid = strict_ ? (double)best < ratio_ * second : (double)best <= ratio_ * second;
+        if (valid)
+        {
+          m.trainIdx = best_idx;
+          m.distance = Distance::toDistance(best);
+        }
+      }
+    }
+
+  private:
+    const cv::Mat& desc_1_;
+    const cv::Mat& desc_2_;
+    const cv::Mat& mask_;
+    double ratio_;
+    bool strict_;
+    cv::DMatch* out_;
+  };
+
+  // Search the two nearest query descriptors of a range of train descriptors and apply the same ratio test
+  // (for the cross check). The nearest query of every train descriptor is written in its slot (-1 when rejected).
+  template<class Distance>
+  class ReverseTop2Body : public cv::ParallelLoopBody
+  {
+  public:
+    typedef typename Distance::ElementType ElementType;
+    typedef typename Distance::ResultType ResultType;
+
+    ReverseTop2Body(const cv::Mat& desc_1, const cv::Mat& desc_2, const cv::Mat& mask,
+                    double ratio, bool strict, int* out) :
+      desc_1_(desc_1), desc_2_(desc_2), mask_(mask), ratio_(Distance::toSquared(ratio)), strict_(strict), out_(out) {}
+
+    virtual void operator()(const cv::Range& range) const
+    {
+      const int cols = desc_2_.cols;
+      for (int j=range.start; j<range.end; j++)
+      {
+        const ElementType* train = desc_2_.ptr<ElementType>(j);
+        ResultType best = numeric_limits<ResultType>::max();
+        ResultType second = numeric_limits<ResultType>::max();
+        int best_idx = -1;
+        for (int i=0; i<desc_1_.rows; i++)
+        {
+          if (!mask_.empty() && !mask_.at<uchar>(i, j)) continue;
+          ResultType d = Distance::distance(desc_1_.ptr<ElementType>(i), train, cols);
+          if (d < best)
+          {
+            second = best;
+            best = d;
+            best_idx = i;
+          }
+          else if (d < second)
+          {
+            second = d;
+          }
+        }
+
+        out_[j] = -1;
+        if (best_idx < 0 || second == numeric_limits<ResultType>::max()) continue;
+        bool valid = strict_ ? (double)best < ratio_ * second : (double)best <= ratio_ * second;
+        if (valid)
+          out_[j] = best_idx;
+      }
+    }
+
+  private:
+    const cv::Mat& desc_1_;
+    const cv::Mat& desc_2_;
+    const cv::Mat& mask_;
+    double ratio_;
+    bool strict_;
+    int* out_;
+  };
+
+  template<class Distance>
+  static void matchImpl(const cv::Mat& desc_1, const cv::Mat& desc_2, double ratio, vector<cv::DMatch>& matches,
+                        bool cross_check, bool strict, const cv::Mat& mask)
+  {
+    matches.resize(desc_1.rows);
+    cv::parallel_for_(cv::Range(0, desc_1.rows),
+                      Top2Body<Distance>(desc_1, desc_2, mask, ratio, strict, matches.data()));
+
+    vector<int> nearest_query;
+    if (cross_check)
+    {
+      nearest_query.resize(desc_2.rows);
+      cv::parallel_for_(cv::Range(0, desc_2.rows),
+                        ReverseTop2Body<Distance>(desc_1, desc_2, mask, ratio, strict, nearest_query.data()));
+    }
+
+    // Compact the accepted matches, in query order
+    size_t n = 0;
+    for (size_t i=0; i<matches.size(); i++)
+    {
+      const cv::DMatch& m = matches[i];
+      if (m.trainIdx < 0) continue;
+      if (cross_check && nearest_query[m.trainIdx] != m.queryIdx) continue;
+      matches[n++] = m;
+    }
+    matches.resize(n);
+  }
+
+  void Top2Matcher::match(const cv::Mat& desc_1, const cv::Mat& desc_2, double ratio, vector<cv::DMatch>& matches,
+                          bool cross_check, bool strict, const cv::Mat& mask)
+  {
+    matches.clear();
+    if (desc_1.empty() || desc_2.empty()) return;
+
+    CV_Assert(desc_1.type() == desc_2.type() && desc_1.cols == desc_2.cols);
+    CV_Assert(mask.empty() || (mask.type() == CV_8U && mask.rows == desc_1.rows && mask.cols == desc_2.rows));
+
+    cv::Mat d1 = desc_1;
+    cv::Mat d2 = desc_2;
+
+    if (d1.type() == CV_8U)
+      matchImpl<Hamming>(d1, d2, ratio, matches, cross_check, strict, mask);
+    else
+    {
+      if (d1.type() != CV_32F)
+      {
+        d1.convertTo(d1, CV_32F);
+        d2.convertTo(d2, CV_32F);
+      }
+      matchImpl<L2Squared>(d1, d2, ratio, matches, cross_check, strict, mask);
+    }
+  }
+
+} // namespace
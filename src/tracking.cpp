@@ -2,14 +2,18 @@
 
 #include "tracking.h"
 #include "tools.h"
+#include "keypoint_grid.h"
+#include "top2_matcher.h"
 
 using namespace tools;
 
 namespace slam
 {
 
-  Tracking::Tracking(Publisher *f_pub, Graph *graph)
-    : f_pub_(f_pub), graph_(graph), frame_id_(0), jump_detected_(false), secs_to_filter_(10.0)
+  Tracking::Tracking(Publisher *f_pub, Graph *graph, FeatureExtractor *feature_extractor)
+    : f_pub_(f_pub), camera_model_ready_(false), graph_(graph), feature_extractor_(feature_extractor), frame_id_(0),
+      jump_detected_(false), secs_to_filter_(10.0), msgs_queue_(TRACKING_QUEUE_SIZE), frames_queue_(TRACKING_QUEUE_SIZE),
+      keyframes_queue_(TRACKING_QUEUE_SIZE)
   {}
 
   void Tracking::run()
@@ -58,15 +62,29 @@ namespace slam
     // Message sync
     boost::shared_ptr<Sync> sync;
     odom_sub      .subscribe(nh, params_.odom_topic, 20);
-    left_sub      .subscribe(it, params_.camera_topic+"/left/image_rect_color", 5);
-    right_sub     .subscribe(it, params_.camera_topic+"/right/image_rect_color", 5);
+    string image_topic = params_.mono_images ? "image_rect" : "image_rect_color";
+    left_sub      .subscribe(it, params_.camera_topic+"/left/"+image_topic, 5);
+    right_sub     .subscribe(it, params_.camera_topic+"/right/"+image_topic, 5);
     left_info_sub .subscribe(nh, params_.camera_topic+"/left/camera_info",  5);
     right_info_sub.subscribe(nh, params_.camera_topic+"/right/camera_info", 5);
     cloud_sub     .subscribe(nh, params_.camera_topic+"/points2", 5);
     sync.reset(new Sync(SyncPolicy(10), odom_sub, left_sub, right_sub, left_info_sub, right_info_sub, cloud_sub) );
     sync->registerCallback(bind(&Tracking::msgsCallback, this, _1, _2, _3, _4, _5, _6));
 
+    // Pipeline threads
+    boost::thread features_thread(&Tracking::featuresThread, this);
+    boost::thread pose_thread(&Tracking::poseThread, this);
+    boost::thread keyframe_thread(&Tracking::keyFrameThread, this);
+
     ros::spin();
+
+    // Stop the pipeline
+    msgs_queue_.close();
+    frames_queue_.close();
+    keyframes_queue_.close();
+    features_thread.join();
+    pose_thread.join();
+    keyframe_thread.join();
   }
 
   void Tracking::msgsCallback(
@@ -77,50 +95,97 @@ namespace slam
       const sensor_msgs::CameraInfoConstPtr& r_info_msg,
       const sensor_msgs::PointCloud2ConstPtr& cloud_msg)
   {
+    FrameMsgs msgs;
+    msgs.odom_msg = odom_msg;
+    msgs.l_img_msg = l_img_msg;
+    msgs.r_img_msg = r_img_msg;
+    msgs.l_info_msg = l_info_msg;
+    msgs.r_info_msg = r_info_msg;
+    msgs.cloud_msg = cloud_msg;
+    msgs_queue_.push(msgs);
+  }
 
-    tf::Transform c_odom_robot = Tools::odomTotf(*odom_msg);
-    double timestamp = l_img_msg->header.stamp.toSec();
+  void Tracking::featuresThread()
+  {
+    FrameMsgs msgs;
+    while (msgs_queue_.pop(msgs))
+    {
+      // Camera parameters
+      if (!camera_model_ready_)
+      {
+        Tools::getCameraModel(*msgs.l_info_msg, *msgs.r_info_msg, camera_model_, camera_matrix_);
+        camera_model_ready_ = true;
+      }
+
+      // The frame features are only extracted here for the stereo matches debugging. Otherwise, only the
+      // keyframes compute them (see addFrameToMap). The odometry refinement tracks the keyframe keypoints
+      // with optical flow, so it only needs the grayscale images. The extractor serializes the extractions of
+      // this thread and the pose thread.
+      double timestamp = msgs.l_img_msg->header.stamp.toSec();
+      FramePtr frame(new Frame(msgs.l_img_msg, msgs.r_img_msg, camera_model_, timestamp, feature_extractor_));
+      bool debug_stereo = f_pub_->hasStereoMatchesSubscribers();
+      if (debug_stereo)
+        frame->computeFeatures();
+      else if (params_.refine)
+        frame->decodeImages();
+
+      // The cloud is only converted for the overlap estimation and filtered for the keyframes
+      frame->setPointCloudMsg(msgs.cloud_msg);
+
+      // Publish stereo matches
+      if (debug_stereo)
+        f_pub_->publishStereoMatches(*frame);
+
+      TrackedFrame tracked_frame;
+      tracked_frame.odom_msg = msgs.odom_msg;
+      tracked_frame.frame = frame;
+      if (!frames_queue_.push(tracked_frame))
+        break;
+    }
+  }
+
+  void Tracking::poseThread()
+  {
+    TrackedFrame tracked_frame;
+    while (frames_queue_.pop(tracked_frame))
+      processFrame(tracked_frame);
+  }
 
-    cv::Mat l_img, r_img;
-    Tools::imgMsgToMat(*l_img_msg, *r_img_msg, l_img, r_img);
+  void Tracking::keyFrameThread()
+  {
+    NewKeyFrame new_keyframe;
+    while (keyframes_queue_.pop(new_keyframe))
+      storeKeyFrame(new_keyframe);
+  }
 
-    PointCloudRGB::Ptr pcl_cloud(new PointCloudRGB);
-    fromROSMsg(*cloud_msg, *pcl_cloud);
+  void Tracking::processFrame(const TrackedFrame& tracked_frame)
+  {
+    const nav_msgs::Odometry::ConstPtr& odom_msg = tracked_frame.odom_msg;
+    tf::Transform c_odom_robot = Tools::odomTotf(*odom_msg);
 
     if (state_ == NOT_INITIALIZED)
     {
       // Transformation between odometry and camera
-      if (!getOdom2CameraTf(*odom_msg, *l_img_msg, odom2camera_))
+      if (!getOdom2CameraTf(*odom_msg, *tracked_frame.frame->getLeftImgMsg(), odom2camera_))
       {
         ROS_WARN("[Localization:] Impossible to transform odometry to camera frame.");
         return;
       }
 
-      // Camera parameters
-      Tools::getCameraModel(*l_info_msg, *r_info_msg, camera_model_, camera_matrix_);
-
-      // Set graph properties
+      // Set graph properties (the camera model is set by the features thread before queuing the frame)
       graph_->setCamera2Odom(odom2camera_.inverse());
       graph_->setCameraMatrix(camera_matrix_);
       graph_->setCameraModel(camera_model_.left());
 
       // The initial frame
-      c_frame_ = Frame(l_img, r_img, camera_model_, timestamp);
-
-      // Filter cloud
-      PointCloudRGB::Ptr cloud_filtered(new PointCloudRGB);
-      cloud_filtered = filterCloud(pcl_cloud);
-      c_frame_.setPointCloud(cloud_filtered);
+      c_frame_ = tracked_frame.frame;
 
       // No corrections apply yet
       prev_robot_pose_ = c_odom_robot;
 
       // For the first frame, its estimated pose will coincide with odometry
       tf::Transform c_odom_camera = c_odom_robot * odom2camera_;
-      c_frame_.setCameraPose(c_odom_camera);
-
-      // Publish stereo matches
-      f_pub_->publishStereoMatches(c_frame_);
+      c_frame_->setCameraPose(c_odom_camera);
 
       bool frame_ok = addFrameToMap();
       if (frame_ok)
@@ -135,10 +200,7 @@ namespace slam
     else
     {
       // The current frame
-      c_frame_ = Frame(l_img, r_img, camera_model_, timestamp);
-
-      // Publish stereo matches
-      f_pub_->publishStereoMatches(c_frame_);
+      c_frame_ = tracked_frame.frame;
 
       // Get the pose of the last frame id
       tf::Transform last_frame_pose;
@@ -156,9 +218,15 @@ namespace slam
       int num_inliers = 0;
       if (params_.refine)
       {
-        cv::Mat sigma;
+        cv::Mat information;
         tf::Transform p2c_diff;
-        bool succeed = refinePose(p_frame_, c_frame_, p2c_diff, sigma, num_inliers);
+        bool succeed = trackPose(c_frame_, p2c_diff, information, num_inliers);
+        if (!succeed)
+        {
+          // Optical flow tracking lost: extract the frame features and match them with the keyframe
+          c_frame_->computeFeatures();
+          succeed = refinePose(p_frame_, *c_frame_, odom_diff, p2c_diff, information, num_inliers);
+        }
         double error = Tools::poseDiff3D(p2c_diff, odom_diff);
         bool refine_valid = succeed && error < 0.3;
 
@@ -166,8 +234,8 @@ namespace slam
         {
           ROS_INFO_STREAM("[Localization:] Pose refine successful, error: " << error << ", inliers: " << num_inliers);
 
-          c_frame_.setInliersNumWithPreviousFrame(num_inliers);
-          c_frame_.setSigmaWithPreviousFrame(sigma);
+          c_frame_->setInliersNumWithPreviousFrame(num_inliers);
+          c_frame_->setInformationWithPreviousFrame(information);
           correction = p2c_diff;
         }
         else
@@ -182,14 +250,8 @@ namespace slam
       }
       c_camera_pose = last_frame_pose * correction;
 
-      // Filter cloud
-      PointCloudRGB::Ptr cloud_filtered(new PointCloudRGB);
-      cloud_filtered = filterCloud(pcl_cloud);
-
-
       // Set frame data
-      c_frame_.setCameraPose(c_camera_pose);
-      c_frame_.setPointCloud(cloud_filtered);
+      c_frame_->setCameraPose(c_camera_pose);
 
       // Need new keyframe
       bool is_new_keyframe = needNewKeyFrame();
@@ -202,7 +264,7 @@ namespace slam
     }
 
     // Convert camera to robot pose
-    tf::Transform robot_pose = c_frame_.getCameraPose() * odom2camera_.inverse();
+    tf::Transform robot_pose = c_frame_->getCameraPose() * odom2camera_.inverse();
 
     // Detect a big jump
     double jump = Tools::poseDiff3D(robot_pose, prev_robot_pose_);
@@ -288,47 +350,42 @@ namespace slam
     else
     {
       // Check odometry distance
-      double pose_diff = Tools::poseDiff3D(p_frame_.getCameraPose(), c_frame_.getCameraPose());
+      double pose_diff = Tools::poseDiff3D(p_frame_->getCameraPose(), c_frame_->getCameraPose());
       if (pose_diff > 0.3)
       {
 
         // Compute overlap to decide if new keyframe is needed.
         float overlap = TRACKING_MIN_OVERLAP - 0.1;
-        if (c_frame_.getPointCloud()->points.size() > MIN_CLOUD_SIZE)
+        const sensor_msgs::PointCloud2ConstPtr& cloud_msg = c_frame_->getPointCloudMsg();
+
+        // The transformation between last and current keyframe
+        tf::Transform last_2_current = p_frame_->getCameraPose().inverse() * c_frame_->getCameraPose();
+
+        int stride = max(1, params_.overlap_stride);
+        CloudScan scan;
+        if (cloud_msg && scanCloud(*cloud_msg, last_2_current, stride, scan) &&
+            scan.num_points * stride > MIN_CLOUD_SIZE)
         {
-          // The transformation between last and current keyframe
-          tf::Transform last_2_current = p_frame_.getCameraPose().inverse() * c_frame_.getCameraPose();
-
-          // Speedup the process by converting the current pointcloud to xyz
-          PointCloudXYZ::Ptr cloud_xyz(new PointCloudXYZ);
-          pcl::copyPointCloud(*c_frame_.getPointCloud(), *cloud_xyz);
-
-          // Transform the current pointcloud
-          Eigen::Affine3d tf_eigen;
-          transformTFToEigen(last_2_current, tf_eigen);
-          PointCloudXYZ::Ptr cloud_xyz_moved(new PointCloudXYZ);
-          pcl::transformPointCloud(*cloud_xyz, *cloud_xyz_moved, tf_eigen);
-
-          // Remove the points that are outside the current pointcloud
-          PointCloudXYZ::Ptr output(new PointCloudXYZ);
-          pcl::CropBox<PointXYZ> crop_filter;
-          crop_filter.setInputCloud(cloud_xyz_moved);
-          crop_filter.setMin(last_min_pt_);
-          crop_filter.setMax(last_max_pt_);
-          crop_filter.filter(*output);
-
-          if (cloud_xyz_moved->points.size() > 0)
-          {
-            // The overlap estimation
-            float overlap = output->points.size() * 100 / cloud_xyz_moved->points.size();
+          // The overlap estimation
+          float ratio = (float)scan.num_inside / scan.num_points;
 
-            // Safety factor
-            overlap = (0.002 * overlap + 0.8) * overlap;
+          // With a subsampled cloud, scan all the points when the threshold is inside the 95% confidence interval
+          if (stride > 1)
+          {
+            float half_width = 1.96 * sqrt(ratio * (1.0 - ratio) / scan.num_points);
+            float low = overlapWithSafetyFactor(100 * max(0.0f, ratio - half_width));
+            float high = overlapWithSafetyFactor(100 * min(1.0f, ratio + half_width));
+            if (low < TRACKING_MIN_OVERLAP && high >= TRACKING_MIN_OVERLAP)
+            {
+              scanCloud(*cloud_msg, last_2_current, 1, scan);
+              ratio = (float)scan.num_inside / max(1, scan.num_points);
+            }
           }
+          overlap = overlapWithSafetyFactor(100 * ratio);
 
           // Publish debugging image
           if (overlapping_pub_.getNumSubscribers() > 0)
-            publishOverlap(cloud_xyz, last_2_current, overlap);
+            publishOverlap(scan, last_2_current, overlap);
         }
 
         // Add frame when overlap is less than...
@@ -343,54 +400,47 @@ namespace slam
 
   bool Tracking::addFrameToMap()
   {
+    // Nothing is done if the features were already computed by the features thread
+    c_frame_->computeFeatures();
 
-    if (c_frame_.getLeftKp().size() > LC_MIN_INLIERS)
+    if (c_frame_->getLeftKp().size() > LC_MIN_INLIERS)
     {
-      c_frame_.regionClustering();
+      c_frame_->regionClustering();
 
       // Check if enough clusters
-      vector< vector<int> > clusters = c_frame_.getClusters();
+      const ClusterSet& clusters = c_frame_->getClusters();
       if (clusters.size() > 0)
       {
         // Add to graph
-        c_frame_.setId(frame_id_);
-        f_pub_->publishClustering(c_frame_);
-        graph_->addFrameToQueue(c_frame_);
+        c_frame_->setId(frame_id_);
+
+        // Only the compact keyframe is sent to the graph, next to the image messages to be saved.
+        // The keyframe is immutable and shared with the graph, not copied.
+        KeyFramePtr keyframe(new KeyFrame(*c_frame_));
 
         // Store previous frame
-        p_frame_ = c_frame_;
+        p_frame_ = keyframe;
 
-        // Get the cloud
-        PointCloudRGB::Ptr cloud(new PointCloudRGB);
-        pcl::copyPointCloud(*c_frame_.getPointCloud(), *cloud);
+        // Track the keyframe keypoints in the next frames
+        resetTracks();
 
-        // Save cloud
-        if (cloud->points.size() > MIN_CLOUD_SIZE)
+        // Store minimum and maximum values of last pointcloud (its finite points, before filtering)
+        CloudScan scan;
+        const sensor_msgs::PointCloud2ConstPtr& cloud_msg = c_frame_->getPointCloudMsg();
+        if (cloud_msg && scanCloud(*cloud_msg, tf::Transform::getIdentity(), 1, scan) && scan.num_points > 0)
         {
-          string pointclouds_dir = WORKING_DIRECTORY + "pointclouds/";
-          string pc_filename = pointclouds_dir + lexical_cast<string>(frame_id_) + ".pcd";
-          pcl::io::savePCDFileBinary(pc_filename, *cloud);
+          last_min_pt_ = scan.min_pt;
+          last_max_pt_ = scan.max_pt;
         }
 
-        // Store minimum and maximum values of last pointcloud
-        pcl::getMinMax3D(*cloud, last_min_pt_, last_max_pt_);
-
-        // Publish cloud
-        if (pc_pub_.getNumSubscribers() > 0 && cloud->points.size() > MIN_CLOUD_SIZE)
-        {
-          // Publish
-          string frame_id_str = Tools::convertTo5digits(frame_id_);
-          sensor_msgs::PointCloud2 cloud_msg;
-          pcl::toROSMsg(*cloud, cloud_msg);
-          cloud_msg.header.frame_id = frame_id_str; // write the keyframe id to the frame id of the message ;)
-          pc_pub_.publish(cloud_msg);
-        }
+        // The keyframe is stored by the keyframe thread
+        NewKeyFrame new_keyframe;
+        new_keyframe.frame = c_frame_;
+        new_keyframe.keyframe = keyframe;
+        keyframes_queue_.push(new_keyframe);
 
         ROS_INFO_STREAM("[Localization:] Adding keyframe " << frame_id_ + 1);
 
-        // Save the keyframe
-
-
         // Increase the frame id counter
         frame_id_++;
         return true;
@@ -402,86 +452,241 @@ namespace slam
       }
     }
 
-    ROS_WARN_STREAM("[Localization:] Not enough keypoints in this frame (" << c_frame_.getLeftKp().size() << ")");
+    ROS_WARN_STREAM("[Localization:] Not enough keypoints in this frame (" << c_frame_->getLeftKp().size() << ")");
     return false;
   }
 
-  bool Tracking::refinePose(Frame query, Frame candidate, tf::Transform& out, cv::Mat& sigma, int& num_inliers)
+  void Tracking::storeKeyFrame(const NewKeyFrame& new_keyframe)
+  {
+    const Frame& frame = *new_keyframe.frame;
+    f_pub_->publishClustering(frame);
+
+    // Add to graph
+    graph_->addFrameToQueue(new_keyframe.keyframe, frame.getLeftImgMsg(), frame.getRightImgMsg());
+
+    // Convert and filter the cloud (only the keyframe clouds are filtered)
+    PointCloudRGB::Ptr cloud(new PointCloudRGB);
+    if (frame.getPointCloudMsg())
+    {
+      fromROSMsg(*frame.getPointCloudMsg(), *cloud);
+      cloud = filterCloud(cloud);
+    }
+    int id = frame.getId();
+
+    // Save cloud
+    if (cloud->points.size() > MIN_CLOUD_SIZE)
+    {
+      string pointclouds_dir = WORKING_DIRECTORY + "pointclouds/";
+      string pc_filename = pointclouds_dir + lexical_cast<string>(id) + ".pcd";
+      pcl::io::savePCDFileBinary(pc_filename, *cloud);
+    }
+
+    // Publish cloud
+    if (pc_pub_.getNumSubscribers() > 0 && cloud->points.size() > MIN_CLOUD_SIZE)
+    {
+      // Publish
+      string frame_id_str = Tools::convertTo5digits(id);
+      sensor_msgs::PointCloud2 cloud_msg;
+      pcl::toROSMsg(*cloud, cloud_msg);
+      cloud_msg.header.frame_id = frame_id_str; // write the keyframe id to the frame id of the message ;)
+      pc_pub_.publish(cloud_msg);
+    }
+  }
+
+  bool Tracking::refinePose(const KeyFramePtr& query, const Frame& candidate, const tf::Transform& prediction,
+                            tf::Transform& out, cv::Mat& information, int& num_inliers)
   {
     // Init
     out.setIdentity();
     num_inliers = LC_MIN_INLIERS;
 
     // Sanity check
-    if (query.getLeftDesc().rows == 0 || candidate.getLeftDesc().rows == 0)
+    if (!query || query->getLeftDesc().rows == 0 || candidate.getLeftDesc().rows == 0)
       return false;
 
-    // Match current and previous left descriptors
-    vector<cv::DMatch> matches;
-    Tools::ratioMatching(query.getLeftDesc(), candidate.getLeftDesc(), 0.8, matches);
-
-    if (matches.size() >= LC_MIN_INLIERS)
+    // Spatial index of the candidate keypoints
+    const vector<cv::KeyPoint>& cand_kp_l = candidate.getLeftKp();
+    const cv::Mat& cand_desc = candidate.getLeftDesc();
+    KeypointGrid grid(cand_kp_l, TRACKING_SEARCH_RADIUS);
+
+    // Project the query 3D points into the candidate image with the predicted motion and match every
+    // point with the candidate keypoints inside the search window
+    const vector<cv::Point3f>& query_3d = query->getCameraPoints();
+    const cv::Mat& query_desc = query->getLeftDesc();
+    const tf::Transform query_2_cand = prediction.inverse();
+    const double fx = camera_matrix_.at<double>(0, 0);
+    const double fy = camera_matrix_.at<double>(1, 1);
+    const double cx = camera_matrix_.at<double>(0, 2);
+    const double cy = camera_matrix_.at<double>(1, 2);
+    const float ratio = 0.8;
+    vector<cv::DMatch> window_matches;
+    vector<int> cand_owner(cand_kp_l.size(), -1);
+    vector<float> quality;
+    vector<int> window;
+    for (uint i=0; i<query_3d.size(); i++)
     {
-      // Get the matched keypoints
-      vector<cv::KeyPoint> query_kp_l = query.getLeftKp();
-      vector<cv::KeyPoint> query_kp_r = query.getRightKp();
-      vector<cv::Point3f> query_3d = query.getCameraPoints();
-      vector<cv::KeyPoint> cand_kp_l = candidate.getLeftKp();
-      vector<cv::KeyPoint> cand_kp_r = candidate.getRightKp();
-      vector<cv::Point3f> cand_3d = candidate.getCameraPoints();
-      vector<cv::Point2f> query_matched_kp_l, query_matched_kp_r;
-      vector<cv::Point2f> cand_matched_kp_l, cand_matched_kp_r;
-      vector<cv::Point3f> cand_matched_3d_points;
-      for(uint i=0; i<matches.size(); i++)
+      tf::Vector3 p = query_2_cand * tf::Vector3(query_3d[i].x, query_3d[i].y, query_3d[i].z);
+      if (p.z() <= 0.0) continue;
+      cv::Point2f proj(fx * p.x() / p.z() + cx, fy * p.y() / p.z() + cy);
+
+      grid.radiusSearch(proj, TRACKING_SEARCH_RADIUS, window);
+      int best_idx = -1;
+      float best_dist = FLT_MAX;
+      float second_dist = FLT_MAX;
+      for (uint j=0; j<window.size(); j++)
       {
-        // Query keypoints
-        query_matched_kp_l.push_back(query_kp_l[matches[i].queryIdx].pt);
-        query_matched_kp_r.push_back(query_kp_r[matches[i].queryIdx].pt);
-
-        // Candidate keypoints
-        cand_matched_kp_l.push_back(cand_kp_l[matches[i].trainIdx].pt);
-        cand_matched_kp_r.push_back(cand_kp_r[matches[i].trainIdx].pt);
-
-        // 3d points
-        cand_matched_3d_points.push_back(cand_3d[matches[i].trainIdx]);
+        float dist = Top2Matcher::distance(query_desc, i, cand_desc, window[j]);
+        if (dist < best_dist)
+        {
+          second_dist = best_dist;
+          best_dist = dist;
+          best_idx = window[j];
+        }
+        else if (dist < second_dist)
+        {
+          second_dist = dist;
+        }
       }
 
-      cv::Mat rvec = cv::Mat::zeros(3, 1, CV_64FC1);
-      cv::Mat tvec = cv::Mat::zeros(3, 1, CV_64FC1);
-      vector<int> inliers;
-      cv::solvePnPRansac(cand_matched_3d_points, query_matched_kp_l, camera_matrix_,
-                         cv::Mat(), rvec, tvec, false,
-                         100, LC_EPIPOLAR_THRESH, 0.99, inliers, cv::SOLVEPNP_ITERATIVE);
+      // Ratio test: a point with a single keypoint inside its window can not be verified, and ties (e.g. two
+      // equal Hamming distances) are ambiguous. A positive second distance also keeps the quality finite.
+      if (best_idx < 0 || second_dist == FLT_MAX || second_dist <= 0.0f || best_dist >= ratio * second_dist) continue;
 
-      // Inliers threshold
-      if (inliers.size() < LC_MIN_INLIERS)
+      // One to one: a candidate keypoint keeps the closest of the points that claim it
+      int owner = cand_owner[best_idx];
+      if (owner >= 0)
       {
-        return false;
+        if (window_matches[owner].distance <= best_dist) continue;
+        window_matches[owner].trainIdx = -1;
       }
-      else
+      cand_owner[best_idx] = window_matches.size();
+      window_matches.push_back(cv::DMatch(i, best_idx, best_dist));
+      quality.push_back(best_dist / second_dist);
+    }
+
+    vector<cv::Point3f> query_matched_3d_points;
+    vector<cv::Point2f> cand_matched_kp_l;
+    vector<float> matched_quality;
+    for (uint i=0; i<window_matches.size(); i++)
+    {
+      if (window_matches[i].trainIdx < 0) continue;
+      query_matched_3d_points.push_back(query_3d[window_matches[i].queryIdx]);
+      cand_matched_kp_l.push_back(cand_kp_l[window_matches[i].trainIdx].pt);
+      matched_quality.push_back(quality[i]);
+    }
+
+    if (query_matched_3d_points.size() < LC_MIN_INLIERS)
+      return false;
+
+    // The distinctive matches are sampled first
+    cv::Mat rvec, tvec;
+    vector<int> inliers;
+    if (!pose_solver_.solve(query_matched_3d_points, cand_matched_kp_l, camera_matrix_, matched_quality,
+                            rvec, tvec, inliers, information))
+      return false;
+
+    // Inliers threshold
+    if (inliers.size() < LC_MIN_INLIERS)
+      return false;
+
+    // The PnP transform moves the query points to the candidate camera: invert it
+    out = Tools::buildTransformation(rvec, tvec).inverse();
+
+    // Save the inliers
+    num_inliers = inliers.size();
+    return true;
+  }
+
+  void Tracking::resetTracks()
+  {
+    track_frame_ = c_frame_;
+    track_kp_.clear();
+    track_points_.clear();
+    if (!params_.refine || !c_frame_->decodeImages()) return;
+
+    const vector<cv::KeyPoint>& kp = c_frame_->getLeftKp();
+    const vector<cv::Point3f>& points = c_frame_->getCameraPoints();
+    track_kp_.reserve(kp.size());
+    for (uint i=0; i<kp.size(); i++)
+      track_kp_.push_back(kp[i].pt);
+    track_points_ = points;
+  }
+
+  bool Tracking::trackPose(const FramePtr& frame, tf::Transform& out, cv::Mat& information, int& num_inliers)
+  {
+    // Init
+    out.setIdentity();
+    num_inliers = 0;
+
+    // Sanity check
+    if (!track_frame_ || (int)track_kp_.size() < LC_MIN_INLIERS || !frame->decodeImages())
+      return false;
+
+    // Follow the keypoints from the last tracked frame
+    vector<cv::Point2f> kp;
+    vector<uchar> status;
+    vector<float> err;
+    cv::calcOpticalFlowPyrLK(track_frame_->getLeftImgGray(), frame->getLeftImgGray(), track_kp_, kp, status, err,
+                             cv::Size(21, 21), 3);
+
+    // Keep the tracked keypoints
+    size_t n = 0;
+    for (size_t i=0; i<kp.size(); i++)
+    {
+      if (!status[i]) continue;
+      kp[n] = kp[i];
+      track_points_[n] = track_points_[i];
+      err[n] = err[i];
+      n++;
+    }
+    kp.resize(n);
+    track_points_.resize(n);
+    err.resize(n);
+
+    bool valid = false;
+    if ((int)n >= LC_MIN_INLIERS)
+    {
+      // The 3D points are in the previous keyframe camera frame. The tracks with the lowest
+      // optical flow error are sampled first
+      cv::Mat rvec, tvec;
+      vector<int> inliers;
+      if (pose_solver_.solve(track_points_, kp, camera_matrix_, err, rvec, tvec, inliers, information) &&
+          inliers.size() >= LC_MIN_INLIERS)
       {
-        // Build output transform
-        out = Tools::buildTransformation(rvec, tvec);
+        // The PnP transform moves the keyframe points to the current camera: invert it
+        out = Tools::buildTransformation(rvec, tvec).inverse();
 
-        // Estimate the covariance
-        cv::Mat J;
-        vector<cv::Point2f> p;
+        // Keep tracking the inliers only
+        vector<cv::Point2f> inliers_kp;
         vector<cv::Point3f> inliers_3d_points;
+        inliers_kp.reserve(inliers.size());
+        inliers_3d_points.reserve(inliers.size());
         for (uint i=0; i<inliers.size(); i++)
-          inliers_3d_points.push_back(cand_matched_3d_points[inliers[i]]);
-        cv::projectPoints(inliers_3d_points, rvec, tvec, camera_matrix_, cv::Mat(), p, J);
-        cv::Mat tmp = cv::Mat(J.t() * J, cv::Rect(0,0,6,6)).inv();
-        cv::sqrt(cv::abs(tmp), sigma);
+        {
+          inliers_kp.push_back(kp[inliers[i]]);
+          inliers_3d_points.push_back(track_points_[inliers[i]]);
+        }
 
-        // Save the inliers
+        kp.swap(inliers_kp);
+        track_points_.swap(inliers_3d_points);
         num_inliers = inliers.size();
-        return true;
+        valid = true;
       }
     }
+
+    if (valid)
+    {
+      track_frame_ = frame;
+      track_kp_.swap(kp);
+    }
     else
     {
-      return false;
+      // Tracks lost until the next keyframe
+      track_frame_.reset();
+      track_kp_.clear();
+      track_points_.clear();
     }
+    return valid;
   }
 
   PointCloudRGB::Ptr Tracking::filterCloud(PointCloudRGB::Ptr in_cloud)
@@ -501,7 +706,74 @@ namespace slam
     return cloud;
   }
 
-  void Tracking::publishOverlap(PointCloudXYZ::Ptr cloud, tf::Transform movement, float overlap)
+  bool Tracking::scanCloud(const sensor_msgs::PointCloud2& cloud_msg, const tf::Transform& movement, int stride, CloudScan& scan) const
+  {
+    scan.num_points = 0;
+    scan.num_inside = 0;
+    scan.min_pt = Eigen::Vector4f(FLT_MAX, FLT_MAX, FLT_MAX, 1.0);
+    scan.max_pt = Eigen::Vector4f(-FLT_MAX, -FLT_MAX, -FLT_MAX, 1.0);
+
+    // Offsets of the coordinates into every point
+    int offset[3] = {-1, -1, -1};
+    for (uint i=0; i<cloud_msg.fields.size(); i++)
+    {
+      const sensor_msgs::PointField& field = cloud_msg.fields[i];
+      if (field.datatype != sensor_msgs::PointField::FLOAT32) continue;
+      if (field.name == "x") offset[0] = field.offset;
+      else if (field.name == "y") offset[1] = field.offset;
+      else if (field.name == "z") offset[2] = field.offset;
+    }
+    if (offset[0] < 0 || offset[1] < 0 || offset[2] < 0 || cloud_msg.is_bigendian || cloud_msg.data.empty())
+      return false;
+
+    // The transformation, as floats
+    const tf::Matrix3x3& basis = movement.getBasis();
+    const tf::Vector3& origin = movement.getOrigin();
+    float r[9], t[3];
+    for (int i=0; i<3; i++)
+    {
+      for (int j=0; j<3; j++)
+        r[3*i + j] = basis[i][j];
+      t[i] = origin[i];
+    }
+    const float min_x = last_min_pt_(0), min_y = last_min_pt_(1), min_z = last_min_pt_(2);
+    const float max_x = last_max_pt_(0), max_y = last_max_pt_(1), max_z = last_max_pt_(2);
+
+    float lo_x = FLT_MAX, lo_y = FLT_MAX, lo_z = FLT_MAX;
+    float hi_x = -FLT_MAX, hi_y = -FLT_MAX, hi_z = -FLT_MAX;
+    int num_points = 0, num_inside = 0;
+    const uint8_t* data = &cloud_msg.data[0];
+    for (uint row=0; row<cloud_msg.height; row++)
+    {
+      const uint8_t* row_data = data + row * cloud_msg.row_step;
+      for (uint col=0; col<cloud_msg.width; col+=stride)
+      {
+        const uint8_t* p = row_data + col * cloud_msg.point_step;
+        float x, y, z;
+        memcpy(&x, p + offset[0], sizeof(float));
+        memcpy(&y, p + offset[1], sizeof(float));
+        memcpy(&z, p + offset[2], sizeof(float));
+        if (!isfinite(x) || !isfinite(y) || !isfinite(z)) continue;
+
+        num_points++;
+        lo_x = min(lo_x, x); lo_y = min(lo_y, y); lo_z = min(lo_z, z);
+        hi_x = max(hi_x, x); hi_y = max(hi_y, y); hi_z = max(hi_z, z);
+
+        float mx = r[0]*x + r[1]*y + r[2]*z + t[0];
+        float my = r[3]*x + r[4]*y + r[5]*z + t[1];
+        float mz = r[6]*x + r[7]*y + r[8]*z + t[2];
+        num_inside += (mx >= min_x) & (mx <= max_x) & (my >= min_y) & (my <= max_y) & (mz >= min_z) & (mz <= max_z);
+      }
+    }
+
+    scan.num_points = num_points;
+    scan.num_inside = num_inside;
+    scan.min_pt = Eigen::Vector4f(lo_x, lo_y, lo_z, 1.0);
+    scan.max_pt = Eigen::Vector4f(hi_x, hi_y, hi_z, 1.0);
+    return true;
+  }
+
+  void Tracking::publishOverlap(const CloudScan& scan, tf::Transform movement, float overlap)
   {
     int w = 512;
     int h = 384;
@@ -514,12 +786,12 @@ namespace slam
     float h_scale = (h/4) / (last_max_pt_(1) - last_min_pt_(1));
 
     // Get boundaries and transform them
-    PointXYZ min_pt, max_pt;
-    pcl::getMinMax3D(*cloud, min_pt, max_pt);
-    tf::Vector3 p1(min_pt.x, max_pt.y, 0.0);
-    tf::Vector3 p2(max_pt.x, max_pt.y, 0.0);
-    tf::Vector3 p3(max_pt.x, min_pt.y, 0.0);
-    tf::Vector3 p4(min_pt.x, min_pt.y, 0.0);
+    const Eigen::Vector4f& min_pt = scan.min_pt;
+    const Eigen::Vector4f& max_pt = scan.max_pt;
+    tf::Vector3 p1(min_pt(0), max_pt(1), 0.0);
+    tf::Vector3 p2(max_pt(0), max_pt(1), 0.0);
+    tf::Vector3 p3(max_pt(0), min_pt(1), 0.0);
+    tf::Vector3 p4(min_pt(0), min_pt(1), 0.0);
     p1 = movement * p1;
     p2 = movement * p2;
     p3 = movement * p3;